@@ -0,0 +1,88 @@
+#include <esp_log.h>
+#include <opus.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "main.h"
+
+// Gaps longer than this are played as silence instead of concealed
+#define MAX_CONCEALED_PACKETS 5
+
+// Decoding is shared by both builds so replay on Linux measures it. Only the
+// device plays the result
+opus_int16 *output_buffer = NULL;
+OpusDecoder *opus_decoder = NULL;
+
+uint32_t audio_frames_decoded = 0;
+uint32_t audio_frames_fec = 0;
+uint32_t audio_frames_plc = 0;
+uint32_t audio_decode_errors = 0;
+
+void lk_init_audio_decoder() {
+  int decoder_error = 0;
+  opus_decoder =
+      opus_decoder_create(SAMPLE_RATE, OPUS_DECODER_CHANNELS, &decoder_error);
+  if (decoder_error != OPUS_OK) {
+    printf("Failed to create OPUS decoder");
+    return;
+  }
+
+  output_buffer = (opus_int16 *)malloc(
+      OPUS_MAX_PACKET_SAMPLES * OPUS_DECODER_CHANNELS * sizeof(opus_int16));
+}
+
+void lk_audio_decoder_reset() {
+  opus_decoder_ctl(opus_decoder, OPUS_RESET_STATE);
+}
+
+// Only play what was decoded, never stale samples from a previous packet
+static void lk_audio_output(int decoded_size) {
+  if (decoded_size < 0) {
+    audio_decode_errors++;
+  }
+  if (decoded_size <= 0) {
+    return;
+  }
+#ifndef LINUX_BUILD
+  lk_audio_play(output_buffer, decoded_size);
+#endif
+}
+
+void lk_audio_decode(uint8_t *data, size_t size, int lost_packets) {
+  const int max_frame_size = OPUS_MAX_PACKET_SAMPLES;
+
+  if (lost_packets > 0 && lost_packets <= MAX_CONCEALED_PACKETS) {
+    // Lost packets are assumed to be as long as the one that followed them
+    auto frame_size = opus_decoder_get_nb_samples(opus_decoder, data, size);
+    if (frame_size <= 0 || frame_size > max_frame_size) {
+      frame_size = max_frame_size;
+    }
+
+    // Only the packet directly before this one is covered by its FEC, the
+    // rest have to be concealed
+    for (int i = 0; i < lost_packets - 1; i++) {
+      lk_audio_output(
+          opus_decode(opus_decoder, NULL, 0, output_buffer, frame_size, 0));
+      audio_frames_plc++;
+    }
+
+    // Falls back to PLC inside Opus if this packet carries no FEC
+    lk_audio_output(
+        opus_decode(opus_decoder, data, size, output_buffer, frame_size, 1));
+    audio_frames_fec++;
+  }
+
+  lk_audio_output(opus_decode(opus_decoder, data, size, output_buffer,
+                              max_frame_size, 0));
+  audio_frames_decoded++;
+}
+
+void lk_audio_decoder_log_stats() {
+  ESP_LOGI(LOG_TAG,
+           "Audio decode: frames=%lu concealed=%lu (fec=%lu plc=%lu) "
+           "errors=%lu",
+           (unsigned long)audio_frames_decoded,
+           (unsigned long)(audio_frames_fec + audio_frames_plc),
+           (unsigned long)audio_frames_fec, (unsigned long)audio_frames_plc,
+           (unsigned long)audio_decode_errors);
+}
@@ -3,10 +3,35 @@
 #include <esp_event.h>
 #include <esp_log.h>
 #include <peer.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifndef LINUX_BUILD
 #include "nvs_flash.h"
 
+#ifdef LK_RECORD_PATH
+#include "esp_vfs_fat.h"
+
+// LK_RECORD_PATH must be under this mount point, checked in CMakeLists.txt
+#define RECORD_MOUNT_POINT "/rec"
+#define RECORD_PARTITION_LABEL "storage"
+
+static void lk_mount_recording_storage() {
+  esp_vfs_fat_mount_config_t mount_config = {};
+  mount_config.max_files = 2;
+  mount_config.format_if_mount_failed = true;
+  mount_config.allocation_unit_size = CONFIG_WL_SECTOR_SIZE;
+
+  wl_handle_t wl_handle;
+  auto err = esp_vfs_fat_spiflash_mount_rw_wl(
+      RECORD_MOUNT_POINT, RECORD_PARTITION_LABEL, &mount_config, &wl_handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(LOG_TAG, "Failed to mount recording storage: %s",
+             esp_err_to_name(err));
+  }
+}
+#endif
+
 extern "C" void app_main(void) {
   esp_err_t ret = nvs_flash_init();
   if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
@@ -21,12 +46,30 @@ extern "C" void app_main(void) {
   lk_init_audio_capture();
   lk_init_audio_decoder();
   lk_wifi();
+#ifdef LK_RECORD_PATH
+  lk_mount_recording_storage();
+  lk_recorder_start(LK_RECORD_PATH);
+#endif
   lk_websocket(LIVEKIT_URL, LIVEKIT_TOKEN);
 }
 #else
-int main(void) {
+int main(int argc, char **argv) {
+  lk_init_audio_decoder();
+
+  // ./src.elf --replay <recording> [speed], speed 0 replays without delays
+  if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+    return lk_replay(argv[2], argc >= 4 ? atof(argv[3]) : 1.0);
+  }
+  // ./src.elf --record-synthetic <recording>, writes a recording for CI
+  if (argc >= 3 && strcmp(argv[1], "--record-synthetic") == 0) {
+    return lk_record_synthetic(argv[2]);
+  }
+
   ESP_ERROR_CHECK(esp_event_loop_create_default());
   peer_init();
+#ifdef LK_RECORD_PATH
+  lk_recorder_start(LK_RECORD_PATH);
+#endif
   lk_websocket(LIVEKIT_URL, LIVEKIT_TOKEN);
 }
 #endif
@@ -3,6 +3,75 @@
 #define LOG_TAG "embedded-sdk"
 #define BUFFER_SAMPLES 320
 #define SAMPLE_RATE 8000
+#define RTP_HEADER_SIZE 12
+
+// Opus frame duration in ms (10, 20, 40 or 60) and how many frames are packed
+// into each RTP packet. Fewer, larger packets cut per-packet overhead (RTP,
+// SRTP tag, UDP/IP, Wi-Fi airtime) at the cost of packetisation delay
+#ifndef OPUS_FRAME_DURATION_MS
+#define OPUS_FRAME_DURATION_MS 20
+#endif
+#ifndef OPUS_FRAMES_PER_PACKET
+#define OPUS_FRAMES_PER_PACKET 1
+#endif
+
+#define OPUS_FRAME_SAMPLES (SAMPLE_RATE * OPUS_FRAME_DURATION_MS / 1000)
+#define OPUS_PACKET_DURATION_MS (OPUS_FRAME_DURATION_MS * OPUS_FRAMES_PER_PACKET)
+// Longest packet Opus allows, and so the most a received packet can decode to
+#define OPUS_MAX_PACKET_DURATION_MS 120
+#define OPUS_MAX_PACKET_SAMPLES (SAMPLE_RATE * OPUS_MAX_PACKET_DURATION_MS / 1000)
+// Received audio is decoded to stereo for the I2S output
+#define OPUS_DECODER_CHANNELS 2
+
+// ptime and maxptime asked of the remote in the subscriber answer. Independent
+// of what we send, which the publisher offer advertises
+#ifndef OPUS_RECEIVE_PTIME_MS
+#define OPUS_RECEIVE_PTIME_MS 20
+#endif
+
+static_assert(OPUS_FRAME_DURATION_MS == 10 || OPUS_FRAME_DURATION_MS == 20 ||
+                  OPUS_FRAME_DURATION_MS == 40 || OPUS_FRAME_DURATION_MS == 60,
+              "OPUS_FRAME_DURATION_MS must be 10, 20, 40 or 60");
+static_assert(OPUS_FRAMES_PER_PACKET >= 1 &&
+                  OPUS_PACKET_DURATION_MS <= OPUS_MAX_PACKET_DURATION_MS,
+              "Opus packets can't be longer than 120ms");
+
+// Record types written by lk_recorder_write
+#define LK_RECORD_SIGNAL_RESPONSE 1
+#define LK_RECORD_SIGNAL_REQUEST 2
+#define LK_RECORD_RTP_AUDIO 3
+#define LK_RECORD_TYPE_MAX 4
+
+// Wi-Fi power profiles, selected at build time with the WIFI_PROFILE env var
+// * WIFI_PROFILE_LOW_LATENCY - Power save off, no background roaming scans
+// * WIFI_PROFILE_BATTERY - Modem sleep with a listen interval that fits
+//   inside the jitter buffer
+#define WIFI_PROFILE_LOW_LATENCY 0
+#define WIFI_PROFILE_BATTERY 1
+
+#ifndef WIFI_PROFILE
+#define WIFI_PROFILE WIFI_PROFILE_LOW_LATENCY
+#endif
+
+// How much receive jitter (in ms) playout is expected to absorb
+#ifndef JITTER_BUFFER_MS
+#if WIFI_PROFILE == WIFI_PROFILE_BATTERY
+#define JITTER_BUFFER_MS 200
+#else
+#define JITTER_BUFFER_MS 40
+#endif
+#endif
+
+// With LK_AUTO_SUBSCRIBE the server subscribes us to every track and tracks
+// we don't want are disabled with TRACK_SETTING. Otherwise we only subscribe
+// to what we want
+#ifndef LK_AUTO_SUBSCRIBE
+#define LK_AUTO_SUBSCRIBE 0
+#endif
+// The receive path has one sequence tracker and one decoder, so packets from
+// a second SSRC would be counted as loss and garble the first stream
+#define MAX_SUBSCRIBED_TRACKS 1
+#define ROOM_MAX_TRACKS 32
 
 PeerConnection *lk_create_peer_connection(int isPublisher);
 void lk_websocket(const char *url, const char *token);
@@ -13,6 +82,22 @@ void lk_populate_answer(char *answer, size_t answer_size, int include_audio);
 void lk_publisher_peer_connection_task(void *user_data);
 void lk_subscriber_peer_connection_task(void *user_data);
 void lk_audio_encoder_task(void *arg);
-void lk_audio_decode(uint8_t *data, size_t size);
+void lk_audio_decode(uint8_t *data, size_t size, int lost_packets);
+void lk_audio_log_stats(void);
+void lk_audio_decoder_reset(void);
+void lk_audio_decoder_log_stats(void);
+void lk_audio_play(const int16_t *pcm, int samples);
+void lk_audio_set_idle(bool idle);
+void lk_audio_set_capture_muted(bool muted);
 void lk_init_audio_encoder();
-void lk_send_audio(PeerConnection *peer_connection);
+int lk_send_audio(PeerConnection *peer_connection);
+void lk_peer_connection_wake(void);
+void lk_publisher_wake(void);
+void lk_subscriber_on_audio_track(uint8_t *data, size_t size);
+bool lk_websocket_handle_signal_message(const uint8_t *data, size_t len);
+void lk_set_participant_subscribed(const char *identity, bool subscribe);
+void lk_set_track_subscribed(const char *track_sid, bool subscribe);
+void lk_recorder_start(const char *path);
+void lk_recorder_write(int type, const uint8_t *data, size_t len);
+int lk_replay(const char *path, double speed);
+int lk_record_synthetic(const char *path);
@@ -1,5 +1,12 @@
-#include <driver/i2s.h>
+#include <driver/gpio.h>
+#include <driver/i2s_std.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <opus.h>
+#include <string.h>
+#include <sys/param.h>
 
 #include "main.h"
 
@@ -12,99 +19,308 @@
 #define ADC_BCLK_PIN 38
 #define ADC_LRCLK_PIN 39
 #define ADC_DATA_PIN 40
+// GPIO driving the amplifier enable/shutdown pin, -1 if the board has none
+#ifndef AMP_ENABLE_PIN
+#define AMP_ENABLE_PIN -1
+#endif
 
 #define OPUS_ENCODER_BITRATE 30000
 #define OPUS_ENCODER_COMPLEXITY 0
+// Loss rate the encoder sizes its in-band FEC for
+#define OPUS_ENCODER_EXPECTED_LOSS_PERC 5
+
+// Playout DMA is split into PLAYOUT_DMA_FRAME_MS buffers, with enough of them
+// to hold the jitter buffer target plus one received packet. Packets concealed
+// after a loss fit too, since the gap they fill has already played out. A
+// remote ignoring our maxptime blocks the subscriber task until there is room
+#ifndef PLAYOUT_DMA_FRAME_MS
+#define PLAYOUT_DMA_FRAME_MS 10
+#endif
+#define PLAYOUT_DMA_FRAME_SAMPLES (SAMPLE_RATE * PLAYOUT_DMA_FRAME_MS / 1000)
+#define PLAYOUT_DMA_DESC_NUM \
+  ((JITTER_BUFFER_MS + OPUS_RECEIVE_PTIME_MS) / PLAYOUT_DMA_FRAME_MS + 1)
+#define PLAYOUT_BYTES_PER_MS \
+  (SAMPLE_RATE / 1000 * OPUS_DECODER_CHANNELS * sizeof(opus_int16))
+
+// Bounds and gains for the clock drift resampler. Correction is in ppm of
+// input consumed per output sample, error is in ms of playout fill
+#define RESAMPLER_MAX_PPM 2000
+#define RESAMPLER_KP 50.0f
+#define RESAMPLER_KI 0.01f
+// Room for the extra output samples when stretching by RESAMPLER_MAX_PPM
+#define RESAMPLER_SLACK_SAMPLES 16
+
+#define CAPTURE_DMA_DESC_NUM 4
+
+// Encoded packets wait in a queue for the publisher task to send them, so a
+// slow SRTP protect or a full Wi-Fi TX queue never blocks capture. Packets
+// captured more than SEND_QUEUE_LATENCY_BUDGET_MS ago are dropped, oldest
+// first
+#ifndef SEND_QUEUE_LATENCY_BUDGET_MS
+#define SEND_QUEUE_LATENCY_BUDGET_MS 100
+#endif
+#define SEND_QUEUE_SLOTS \
+  (SEND_QUEUE_LATENCY_BUDGET_MS / OPUS_PACKET_DURATION_MS + 2)
+#define SEND_PACKET_MAX_SIZE (OPUS_OUT_BUFFER_SIZE * OPUS_FRAMES_PER_PACKET)
+// A backlog after a stall is sent at most this many times faster than it was
+// captured, instead of as one burst
+#define SEND_PACER_SPEEDUP 2
+#define SEND_PACER_INTERVAL_US \
+  (OPUS_PACKET_DURATION_MS * 1000 / SEND_PACER_SPEEDUP)
+
+i2s_chan_handle_t i2s_tx_channel = NULL;
+i2s_chan_handle_t i2s_rx_channel = NULL;
+opus_int16 *resampler_buffer = NULL;
+
+// Bytes written to the playout DMA that haven't been clocked out yet.
+// Incremented by lk_audio_play, decremented from the DMA ISR
+static portMUX_TYPE playout_lock = portMUX_INITIALIZER_UNLOCKED;
+volatile int32_t playout_queued_bytes = 0;
+volatile uint32_t playout_underruns = 0;
+
+static IRAM_ATTR bool lk_i2s_on_sent(i2s_chan_handle_t handle,
+                                     i2s_event_data_t *event, void *user_ctx) {
+  portENTER_CRITICAL_ISR(&playout_lock);
+  playout_queued_bytes = MAX(0, playout_queued_bytes - (int32_t)event->size);
+  portEXIT_CRITICAL_ISR(&playout_lock);
+  return false;
+}
+
+// DMA finished a buffer nothing new was written to, so it played silence
+static IRAM_ATTR bool lk_i2s_on_send_q_ovf(i2s_chan_handle_t handle,
+                                           i2s_event_data_t *event,
+                                           void *user_ctx) {
+  playout_underruns++;
+  return false;
+}
 
 void lk_init_audio_capture() {
-  i2s_config_t i2s_config_out = {
-      .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX),
-      .sample_rate = SAMPLE_RATE,
-      .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
-      .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,
-      .communication_format = I2S_COMM_FORMAT_I2S_MSB,
-      .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
-      .dma_buf_count = 8,
-      .dma_buf_len = BUFFER_SAMPLES,
-      .use_apll = 1,
-      .tx_desc_auto_clear = true,
-  };
-  if (i2s_driver_install(I2S_NUM_0, &i2s_config_out, 0, NULL) != ESP_OK) {
+  i2s_chan_config_t tx_chan_cfg =
+      I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
+  tx_chan_cfg.dma_desc_num = PLAYOUT_DMA_DESC_NUM;
+  tx_chan_cfg.dma_frame_num = PLAYOUT_DMA_FRAME_SAMPLES;
+  tx_chan_cfg.auto_clear = true;
+  if (i2s_new_channel(&tx_chan_cfg, &i2s_tx_channel, NULL) != ESP_OK) {
     printf("Failed to configure I2S driver for audio output");
     return;
   }
 
-  i2s_pin_config_t pin_config_out = {
-      .mck_io_num = MCLK_PIN,
-      .bck_io_num = DAC_BCLK_PIN,
-      .ws_io_num = DAC_LRCLK_PIN,
-      .data_out_num = DAC_DATA_PIN,
-      .data_in_num = I2S_PIN_NO_CHANGE,
+  i2s_std_config_t tx_std_cfg = {
+      .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(SAMPLE_RATE),
+      .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT,
+                                                      I2S_SLOT_MODE_STEREO),
+      .gpio_cfg =
+          {
+              .mclk = (gpio_num_t)MCLK_PIN,
+              .bclk = (gpio_num_t)DAC_BCLK_PIN,
+              .ws = (gpio_num_t)DAC_LRCLK_PIN,
+              .dout = (gpio_num_t)DAC_DATA_PIN,
+              .din = I2S_GPIO_UNUSED,
+              .invert_flags = {},
+          },
   };
-  if (i2s_set_pin(I2S_NUM_0, &pin_config_out) != ESP_OK) {
+  if (i2s_channel_init_std_mode(i2s_tx_channel, &tx_std_cfg) != ESP_OK) {
     printf("Failed to set I2S pins for audio output");
     return;
   }
-  i2s_zero_dma_buffer(I2S_NUM_0);
-
-  i2s_config_t i2s_config_in = {
-      .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX),
-      .sample_rate = SAMPLE_RATE,
-      .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
-      .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
-      .communication_format = I2S_COMM_FORMAT_I2S_MSB,
-      .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
-      .dma_buf_count = 8,
-      .dma_buf_len = BUFFER_SAMPLES,
-      .use_apll = 1,
-  };
-  if (i2s_driver_install(I2S_NUM_1, &i2s_config_in, 0, NULL) != ESP_OK) {
+
+  i2s_event_callbacks_t tx_callbacks = {};
+  tx_callbacks.on_sent = lk_i2s_on_sent;
+  tx_callbacks.on_send_q_ovf = lk_i2s_on_send_q_ovf;
+  i2s_channel_register_event_callback(i2s_tx_channel, &tx_callbacks, NULL);
+  i2s_channel_enable(i2s_tx_channel);
+
+  if (AMP_ENABLE_PIN >= 0) {
+    gpio_reset_pin((gpio_num_t)AMP_ENABLE_PIN);
+    gpio_set_direction((gpio_num_t)AMP_ENABLE_PIN, GPIO_MODE_OUTPUT);
+    gpio_set_level((gpio_num_t)AMP_ENABLE_PIN, 1);
+  }
+
+  i2s_chan_config_t rx_chan_cfg =
+      I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_1, I2S_ROLE_MASTER);
+  rx_chan_cfg.dma_desc_num = CAPTURE_DMA_DESC_NUM;
+  rx_chan_cfg.dma_frame_num = OPUS_FRAME_SAMPLES;
+  if (i2s_new_channel(&rx_chan_cfg, NULL, &i2s_rx_channel) != ESP_OK) {
     printf("Failed to configure I2S driver for audio input");
     return;
   }
 
-  i2s_pin_config_t pin_config_in = {
-      .mck_io_num = MCLK_PIN,
-      .bck_io_num = ADC_BCLK_PIN,
-      .ws_io_num = ADC_LRCLK_PIN,
-      .data_out_num = I2S_PIN_NO_CHANGE,
-      .data_in_num = ADC_DATA_PIN,
+  i2s_std_config_t rx_std_cfg = {
+      .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(SAMPLE_RATE),
+      .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT,
+                                                      I2S_SLOT_MODE_MONO),
+      .gpio_cfg =
+          {
+              .mclk = (gpio_num_t)MCLK_PIN,
+              .bclk = (gpio_num_t)ADC_BCLK_PIN,
+              .ws = (gpio_num_t)ADC_LRCLK_PIN,
+              .dout = I2S_GPIO_UNUSED,
+              .din = (gpio_num_t)ADC_DATA_PIN,
+              .invert_flags = {},
+          },
   };
-  if (i2s_set_pin(I2S_NUM_1, &pin_config_in) != ESP_OK) {
+  rx_std_cfg.slot_cfg.slot_mask = I2S_STD_SLOT_LEFT;
+  if (i2s_channel_init_std_mode(i2s_rx_channel, &rx_std_cfg) != ESP_OK) {
     printf("Failed to set I2S pins for audio input");
     return;
   }
+  i2s_channel_enable(i2s_rx_channel);
+
+  resampler_buffer = (opus_int16 *)malloc(
+      (OPUS_MAX_PACKET_SAMPLES + RESAMPLER_SLACK_SAMPLES) *
+      OPUS_DECODER_CHANNELS * sizeof(opus_int16));
 }
 
-opus_int16 *output_buffer = NULL;
-OpusDecoder *opus_decoder = NULL;
+// Linear interpolation between the last sample of the previous block and the
+// current block. resampler_phase is the Q32 position past resampler_last
+opus_int16 resampler_last[OPUS_DECODER_CHANNELS] = {0};
+uint64_t resampler_phase = 0;
+float resampler_fill_ms = 0;
+float resampler_drift_ppm = 0;
+float resampler_correction_ppm = 0;
 
-void lk_init_audio_decoder() {
-  int decoder_error = 0;
-  opus_decoder = opus_decoder_create(SAMPLE_RATE, 2, &decoder_error);
-  if (decoder_error != OPUS_OK) {
-    printf("Failed to create OPUS decoder");
-    return;
+// Stretch or squeeze by correction_ppm. Positive values consume input faster
+// than real time, producing fewer output samples
+static int lk_resample(const opus_int16 *in, int in_samples, opus_int16 *out,
+                       float correction_ppm) {
+  const uint64_t step =
+      (uint64_t)((1.0f + correction_ppm / 1000000.0f) * 4294967296.0f);
+  int out_samples = 0;
+
+  while ((int)(resampler_phase >> 32) < in_samples &&
+         out_samples < in_samples + RESAMPLER_SLACK_SAMPLES) {
+    auto i = (int)(resampler_phase >> 32);
+    auto frac = (int64_t)(resampler_phase & 0xFFFFFFFF);
+    for (int c = 0; c < OPUS_DECODER_CHANNELS; c++) {
+      int32_t a = i == 0 ? resampler_last[c]
+                         : in[(i - 1) * OPUS_DECODER_CHANNELS + c];
+      int32_t b = in[i * OPUS_DECODER_CHANNELS + c];
+      out[out_samples * OPUS_DECODER_CHANNELS + c] =
+          (opus_int16)(a + (((b - a) * frac) >> 32));
+    }
+    out_samples++;
+    resampler_phase += step;
+  }
+
+  resampler_phase -= (uint64_t)in_samples << 32;
+  for (int c = 0; c < OPUS_DECODER_CHANNELS; c++) {
+    resampler_last[c] = in[(in_samples - 1) * OPUS_DECODER_CHANNELS + c];
   }
+  return out_samples;
+}
+
+// Keep the playout DMA fill at JITTER_BUFFER_MS. The integral term settles at
+// the clock drift between the remote sender and our I2S clock
+static void lk_update_resampler(int32_t queued_bytes) {
+  auto fill_ms = (float)queued_bytes / PLAYOUT_BYTES_PER_MS;
+  resampler_fill_ms += (fill_ms - resampler_fill_ms) / 16;
 
-  output_buffer = (opus_int16 *)malloc(BUFFER_SAMPLES * sizeof(opus_int16));
+  auto error_ms = resampler_fill_ms - JITTER_BUFFER_MS;
+  resampler_drift_ppm = MIN(MAX(resampler_drift_ppm + RESAMPLER_KI * error_ms,
+                                -RESAMPLER_MAX_PPM),
+                            RESAMPLER_MAX_PPM);
+  resampler_correction_ppm =
+      MIN(MAX(resampler_drift_ppm + RESAMPLER_KP * error_ms,
+              -RESAMPLER_MAX_PPM),
+          RESAMPLER_MAX_PPM);
 }
 
-void lk_audio_decode(uint8_t *data, size_t size) {
-  int decoded_size =
-      opus_decode(opus_decoder, data, size, output_buffer, BUFFER_SAMPLES, 0);
+static void lk_playout_write(const void *data, size_t size) {
+  size_t bytes_written = 0;
+  i2s_channel_write(i2s_tx_channel, data, size, &bytes_written, portMAX_DELAY);
 
-  if (decoded_size > 0) {
-    size_t bytes_written = 0;
-    i2s_write(I2S_NUM_0, output_buffer, BUFFER_SAMPLES * sizeof(opus_int16),
-              &bytes_written, portMAX_DELAY);
+  portENTER_CRITICAL(&playout_lock);
+  playout_queued_bytes += bytes_written;
+  portEXIT_CRITICAL(&playout_lock);
+}
+
+void lk_audio_play(const opus_int16 *pcm, int samples) {
+  portENTER_CRITICAL(&playout_lock);
+  auto queued_bytes = playout_queued_bytes;
+  portEXIT_CRITICAL(&playout_lock);
+
+  // Playout ran dry. Re-prime with silence instead of letting every packet
+  // from now on play out just in time
+  if (queued_bytes == 0) {
+    memset(resampler_buffer, 0, PLAYOUT_BYTES_PER_MS);
+    for (int i = 0; i < JITTER_BUFFER_MS; i++) {
+      lk_playout_write(resampler_buffer, PLAYOUT_BYTES_PER_MS);
+    }
+    queued_bytes = JITTER_BUFFER_MS * PLAYOUT_BYTES_PER_MS;
+    resampler_fill_ms = JITTER_BUFFER_MS;
+  }
+
+  lk_update_resampler(queued_bytes);
+  auto resampled_size =
+      lk_resample(pcm, samples, resampler_buffer, resampler_correction_ppm);
+  lk_playout_write(resampler_buffer, resampled_size * OPUS_DECODER_CHANNELS *
+                                         sizeof(opus_int16));
+}
+
+// Stop clocking I2S and power down the amplifier while nobody is speaking.
+// Resuming is fast enough to play the packet that triggered it
+void lk_audio_set_idle(bool idle) {
+  if (idle) {
+    i2s_channel_disable(i2s_tx_channel);
+    if (AMP_ENABLE_PIN >= 0) {
+      gpio_set_level((gpio_num_t)AMP_ENABLE_PIN, 0);
+    }
+    return;
+  }
+
+  // Whatever was in the DMA buffers is gone, and the decoder state is from
+  // before the pause
+  portENTER_CRITICAL(&playout_lock);
+  playout_queued_bytes = 0;
+  portEXIT_CRITICAL(&playout_lock);
+  lk_audio_decoder_reset();
+
+  if (AMP_ENABLE_PIN >= 0) {
+    gpio_set_level((gpio_num_t)AMP_ENABLE_PIN, 1);
   }
+  i2s_channel_enable(i2s_tx_channel);
 }
 
 OpusEncoder *opus_encoder = NULL;
+OpusRepacketizer *opus_repacketizer = NULL;
 opus_int16 *encoder_input_buffer = NULL;
+uint8_t *encoder_frame_buffers[OPUS_FRAMES_PER_PACKET];
 uint8_t *encoder_output_buffer = NULL;
 
+typedef struct {
+  // When the last sample of the packet was read from I2S
+  int64_t captured_us;
+  opus_int32 size;
+  uint8_t *data;
+} lk_send_packet_t;
+
+// Ring buffer of send_queue_count packets starting at send_queue_head,
+// guarded by send_queue_mutex
+SemaphoreHandle_t send_queue_mutex = NULL;
+lk_send_packet_t send_queue[SEND_QUEUE_SLOTS];
+int send_queue_head = 0;
+int send_queue_count = 0;
+// Packets dropped since the last one sent, and the TOC byte of the last one
+int send_queue_lost = 0;
+uint8_t send_queue_lost_toc = 0;
+uint8_t *send_buffer = NULL;
+int64_t send_pacer_next_us = 0;
+
+// Set when the server mutes our track. The encoder task then stops capturing
+// until capture_unmuted is given
+volatile bool capture_muted = false;
+SemaphoreHandle_t capture_unmuted = NULL;
+
+// Send stats, guarded by send_queue_mutex
+uint32_t audio_packets_sent = 0;
+uint32_t audio_bytes_sent = 0;
+uint32_t audio_packets_dropped = 0;
+// Reset on every lk_audio_log_stats
+int64_t send_queue_delay_total_us = 0;
+int64_t send_queue_delay_max_us = 0;
+uint32_t send_queue_delay_count = 0;
+int64_t send_blocked_max_us = 0;
+
 void lk_init_audio_encoder() {
   int encoder_error;
   opus_encoder = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP,
@@ -123,20 +339,234 @@ void lk_init_audio_encoder() {
   opus_encoder_ctl(opus_encoder, OPUS_SET_BITRATE(OPUS_ENCODER_BITRATE));
   opus_encoder_ctl(opus_encoder, OPUS_SET_COMPLEXITY(OPUS_ENCODER_COMPLEXITY));
   opus_encoder_ctl(opus_encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
-  encoder_input_buffer = (opus_int16 *)malloc(BUFFER_SAMPLES);
-  encoder_output_buffer = (uint8_t *)malloc(OPUS_OUT_BUFFER_SIZE);
+  opus_encoder_ctl(opus_encoder, OPUS_SET_INBAND_FEC(1));
+  opus_encoder_ctl(opus_encoder,
+                   OPUS_SET_PACKET_LOSS_PERC(OPUS_ENCODER_EXPECTED_LOSS_PERC));
+  encoder_input_buffer =
+      (opus_int16 *)malloc(OPUS_FRAME_SAMPLES * sizeof(opus_int16));
+
+  // Frames are encoded separately and then joined into one packet, which
+  // needs every frame kept until the packet is built
+  if (OPUS_FRAMES_PER_PACKET > 1) {
+    opus_repacketizer = opus_repacketizer_create();
+    for (int i = 0; i < OPUS_FRAMES_PER_PACKET; i++) {
+      encoder_frame_buffers[i] = (uint8_t *)malloc(OPUS_OUT_BUFFER_SIZE);
+    }
+  }
+  encoder_output_buffer = (uint8_t *)malloc(SEND_PACKET_MAX_SIZE);
+
+  for (int i = 0; i < SEND_QUEUE_SLOTS; i++) {
+    send_queue[i].data = (uint8_t *)malloc(SEND_PACKET_MAX_SIZE);
+  }
+  send_buffer = (uint8_t *)malloc(SEND_PACKET_MAX_SIZE);
+  send_queue_mutex = xSemaphoreCreateMutex();
+  capture_unmuted = xSemaphoreCreateBinary();
+
+  ESP_LOGI(LOG_TAG, "Opus encoder: %dms frames, %d frame(s) per packet",
+           OPUS_FRAME_DURATION_MS, OPUS_FRAMES_PER_PACKET);
 }
 
-void lk_send_audio(PeerConnection *peer_connection) {
+static opus_int32 lk_encode_frame(uint8_t *output, int64_t *captured_us) {
   size_t bytes_read = 0;
+  i2s_channel_read(i2s_rx_channel, encoder_input_buffer,
+                   OPUS_FRAME_SAMPLES * sizeof(opus_int16), &bytes_read,
+                   portMAX_DELAY);
+  *captured_us = esp_timer_get_time();
 
-  i2s_read(I2S_NUM_1, encoder_input_buffer, BUFFER_SAMPLES, &bytes_read,
-           portMAX_DELAY);
+  return opus_encode(opus_encoder, encoder_input_buffer, OPUS_FRAME_SAMPLES,
+                     output, OPUS_OUT_BUFFER_SIZE);
+}
 
-  auto encoded_size =
-      opus_encode(opus_encoder, encoder_input_buffer, BUFFER_SAMPLES / 2,
-                  encoder_output_buffer, OPUS_OUT_BUFFER_SIZE);
+static opus_int32 lk_encode_packet(int64_t *captured_us) {
+  if (OPUS_FRAMES_PER_PACKET == 1) {
+    return lk_encode_frame(encoder_output_buffer, captured_us);
+  }
+
+  opus_repacketizer_init(opus_repacketizer);
+  for (int i = 0; i < OPUS_FRAMES_PER_PACKET; i++) {
+    auto frame_size = lk_encode_frame(encoder_frame_buffers[i], captured_us);
+    if (frame_size < 0 ||
+        opus_repacketizer_cat(opus_repacketizer, encoder_frame_buffers[i],
+                              frame_size) != OPUS_OK) {
+      ESP_LOGE(LOG_TAG, "Failed to packetize Opus frame");
+      return -1;
+    }
+  }
+  return opus_repacketizer_out(opus_repacketizer, encoder_output_buffer,
+                               SEND_PACKET_MAX_SIZE);
+}
+
+static void lk_send_queue_drop_oldest() {
+  send_queue_lost_toc = send_queue[send_queue_head].data[0];
+  send_queue_head = (send_queue_head + 1) % SEND_QUEUE_SLOTS;
+  send_queue_count--;
+  send_queue_lost++;
+  audio_packets_dropped++;
+}
+
+// Must be called with send_queue_mutex held
+static void lk_send_queue_drop_expired(int64_t now) {
+  while (send_queue_count > 0 &&
+         now - send_queue[send_queue_head].captured_us >
+             SEND_QUEUE_LATENCY_BUDGET_MS * 1000) {
+    lk_send_queue_drop_oldest();
+  }
+}
+
+static void lk_send_queue_push(const uint8_t *data, opus_int32 size,
+                               int64_t captured_us) {
+  if (xSemaphoreTake(send_queue_mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+
+  lk_send_queue_drop_expired(esp_timer_get_time());
+  if (send_queue_count == SEND_QUEUE_SLOTS) {
+    lk_send_queue_drop_oldest();
+  }
+
+  auto packet =
+      &send_queue[(send_queue_head + send_queue_count) % SEND_QUEUE_SLOTS];
+  memcpy(packet->data, data, size);
+  packet->size = size;
+  packet->captured_us = captured_us;
+  send_queue_count++;
+
+  xSemaphoreGive(send_queue_mutex);
+}
+
+void lk_audio_set_capture_muted(bool muted) {
+  capture_muted = muted;
+  if (!muted && capture_unmuted != NULL) {
+    xSemaphoreGive(capture_unmuted);
+  }
+}
+
+// Nothing is captured, encoded or sent while muted, and queued audio from
+// before the mute is dropped without lost packets in its place
+static void lk_wait_while_capture_muted() {
+  if (!capture_muted) {
+    return;
+  }
+
+  i2s_channel_disable(i2s_rx_channel);
+  if (xSemaphoreTake(send_queue_mutex, portMAX_DELAY) == pdTRUE) {
+    send_queue_count = 0;
+    send_queue_lost = 0;
+    xSemaphoreGive(send_queue_mutex);
+  }
+
+  while (capture_muted) {
+    xSemaphoreTake(capture_unmuted, portMAX_DELAY);
+  }
+
+  opus_encoder_ctl(opus_encoder, OPUS_RESET_STATE);
+  i2s_channel_enable(i2s_rx_channel);
+}
+
+// Captures and encodes audio into the send queue. Runs in its own task so
+// capture keeps up with I2S while the publisher task is stuck sending
+void lk_audio_encoder_task(void *arg) {
+  lk_init_audio_encoder();
+
+  while (1) {
+    lk_wait_while_capture_muted();
+    int64_t captured_us;
+    auto encoded_size = lk_encode_packet(&captured_us);
+    if (encoded_size > 0) {
+      lk_send_queue_push(encoder_output_buffer, encoded_size, captured_us);
+      lk_publisher_wake();
+    }
+  }
+}
+
+// Sends the oldest queued packet if the pacer allows. Returns how many ms
+// until it should be called again, or -1 if the queue is empty
+int lk_send_audio(PeerConnection *peer_connection) {
+  if (send_queue_mutex == NULL ||
+      xSemaphoreTake(send_queue_mutex, portMAX_DELAY) != pdTRUE) {
+    return -1;
+  }
+
+  auto now = esp_timer_get_time();
+  lk_send_queue_drop_expired(now);
+  if (send_queue_count == 0) {
+    xSemaphoreGive(send_queue_mutex);
+    return -1;
+  }
+  if (now < send_pacer_next_us) {
+    xSemaphoreGive(send_queue_mutex);
+    return (send_pacer_next_us - now + 999) / 1000;
+  }
+
+  auto packet = &send_queue[send_queue_head];
+  auto size = packet->size;
+  auto queue_delay = now - packet->captured_us;
+  memcpy(send_buffer, packet->data, size);
+  send_queue_head = (send_queue_head + 1) % SEND_QUEUE_SLOTS;
+  send_queue_count--;
+  auto more_queued = send_queue_count > 0;
+  auto lost = send_queue_lost;
+  // libpeer numbers RTP packets itself, so a dropped packet is replaced by
+  // one with the same frames but no data, which decoders conceal as lost.
+  // The receiver then sees the gap instead of audio played too early
+  uint8_t lost_packet[] = {(uint8_t)(send_queue_lost_toc | 3),
+                           OPUS_FRAMES_PER_PACKET};
+  send_queue_lost = 0;
+  xSemaphoreGive(send_queue_mutex);
+
+  for (int i = 0; i < lost; i++) {
+    peer_connection_send_audio(peer_connection, lost_packet,
+                               sizeof(lost_packet));
+  }
+  peer_connection_send_audio(peer_connection, send_buffer, size);
+
+  auto sent_at = esp_timer_get_time();
+  send_pacer_next_us = now + SEND_PACER_INTERVAL_US;
+  if (xSemaphoreTake(send_queue_mutex, portMAX_DELAY) == pdTRUE) {
+    audio_packets_sent++;
+    audio_bytes_sent += size;
+    send_queue_delay_total_us += queue_delay;
+    send_queue_delay_count++;
+    send_queue_delay_max_us = MAX(send_queue_delay_max_us, queue_delay);
+    send_blocked_max_us = MAX(send_blocked_max_us, sent_at - now);
+    xSemaphoreGive(send_queue_mutex);
+  }
+
+  if (!more_queued) {
+    return -1;
+  }
+  return MAX((send_pacer_next_us - sent_at + 999) / 1000, (int64_t)0);
+}
+
+void lk_audio_log_stats() {
+  ESP_LOGI(LOG_TAG,
+           "Playout: latency=%.1fms target=%dms drift=%+.0fppm "
+           "correction=%+.0fppm underruns=%lu",
+           resampler_fill_ms, JITTER_BUFFER_MS, resampler_drift_ppm,
+           resampler_correction_ppm, (unsigned long)playout_underruns);
+  if (send_queue_mutex == NULL ||
+      xSemaphoreTake(send_queue_mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+  auto packets_sent = audio_packets_sent;
+  auto bytes_sent = audio_bytes_sent;
+  auto packets_dropped = audio_packets_dropped;
+  auto queue_delay_ms = send_queue_delay_count
+                            ? send_queue_delay_total_us / 1000.0 /
+                                  send_queue_delay_count
+                            : 0.0;
+  auto max_queue_delay_ms = send_queue_delay_max_us / 1000.0;
+  auto max_send_ms = send_blocked_max_us / 1000.0;
+  send_queue_delay_total_us = 0;
+  send_queue_delay_count = 0;
+  send_queue_delay_max_us = 0;
+  send_blocked_max_us = 0;
+  xSemaphoreGive(send_queue_mutex);
 
-  peer_connection_send_audio(peer_connection, encoder_output_buffer,
-                             encoded_size);
+  ESP_LOGI(LOG_TAG,
+           "Audio send: packets=%lu payload_bytes=%lu ptime=%dms dropped=%lu "
+           "queue_delay=%.1fms max_queue_delay=%.1fms max_send=%.1fms",
+           (unsigned long)packets_sent, (unsigned long)bytes_sent,
+           OPUS_PACKET_DURATION_MS, (unsigned long)packets_dropped,
+           queue_delay_ms, max_queue_delay_ms, max_send_ms);
 }
@@ -0,0 +1,489 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <livekit_rtc.pb-c.h>
+#include <math.h>
+#include <opus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+
+// Recordings start with RECORDER_MAGIC followed by records of
+// * type (1 byte, LK_RECORD_*)
+// * microseconds since the previous record (varint)
+// * payload length (varint)
+// * payload
+//
+// SignalResponse/SignalRequest payloads are the packed protobuf, RTP payloads
+// are the full packet including the RTP header
+#define RECORDER_MAGIC "LKREC1"
+#define RECORDER_MAGIC_SIZE 6
+#define RECORDER_FILE_BUFFER_SIZE 4096
+#define RECORDER_MAX_RECORD_SIZE (256 * 1024)
+
+extern SemaphoreHandle_t g_mutex;
+extern char *subscriber_offer_buffer;
+extern char *ice_candidate_buffer;
+extern char *publisher_signaling_buffer;
+extern uint32_t audio_decode_errors;
+
+FILE *recorder_file = NULL;
+SemaphoreHandle_t recorder_mutex = NULL;
+int64_t recorder_last_record_us = 0;
+
+static void lk_write_varint(FILE *file, uint64_t value) {
+  uint8_t buffer[10];
+  size_t len = 0;
+  do {
+    buffer[len] = value & 0x7F;
+    value >>= 7;
+    if (value != 0) {
+      buffer[len] |= 0x80;
+    }
+    len++;
+  } while (value != 0);
+  fwrite(buffer, 1, len, file);
+}
+
+static bool lk_read_varint(FILE *file, uint64_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    auto byte = fgetc(file);
+    if (byte == EOF) {
+      return false;
+    }
+    *value |= (uint64_t)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void lk_recorder_start(const char *path) {
+  recorder_mutex = xSemaphoreCreateMutex();
+  if (recorder_mutex == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to create recorder mutex.");
+    return;
+  }
+
+  auto file = fopen(path, "wb");
+  if (file == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to open recording %s", path);
+    return;
+  }
+
+  setvbuf(file, NULL, _IOFBF, RECORDER_FILE_BUFFER_SIZE);
+  fwrite(RECORDER_MAGIC, 1, RECORDER_MAGIC_SIZE, file);
+  recorder_last_record_us = esp_timer_get_time();
+  recorder_file = file;
+  ESP_LOGI(LOG_TAG, "Recording to %s", path);
+}
+
+static void lk_recorder_write_at(int type, const uint8_t *data, size_t len,
+                                 int64_t now) {
+  if (recorder_file == NULL ||
+      xSemaphoreTake(recorder_mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+
+  fputc(type, recorder_file);
+  lk_write_varint(recorder_file, now - recorder_last_record_us);
+  lk_write_varint(recorder_file, len);
+  fwrite(data, 1, len, recorder_file);
+  recorder_last_record_us = now;
+
+  // RTP is written often enough to flush itself. Flush signaling so a crash
+  // right after a bad message still has it on disk
+  if (type != LK_RECORD_RTP_AUDIO) {
+    fflush(recorder_file);
+#ifndef LINUX_BUILD
+    // FATFS keeps its own sector cache
+    fsync(fileno(recorder_file));
+#endif
+  }
+
+  xSemaphoreGive(recorder_mutex);
+}
+
+void lk_recorder_write(int type, const uint8_t *data, size_t len) {
+  lk_recorder_write_at(type, data, len, esp_timer_get_time());
+}
+
+// Replay has no PeerConnection tasks consuming what the handlers buffer, so
+// release it ourselves so the next message is handled the same way
+static void lk_replay_drain_signaling() {
+  if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
+    free(subscriber_offer_buffer);
+    subscriber_offer_buffer = NULL;
+    free(ice_candidate_buffer);
+    ice_candidate_buffer = NULL;
+    free(publisher_signaling_buffer);
+    publisher_signaling_buffer = NULL;
+    xSemaphoreGive(g_mutex);
+  }
+}
+
+static const char *lk_record_type_to_string(int type) {
+  switch (type) {
+    case LK_RECORD_SIGNAL_RESPONSE:
+      return "SignalResponse";
+    case LK_RECORD_SIGNAL_REQUEST:
+      return "SignalRequest";
+    case LK_RECORD_RTP_AUDIO:
+      return "RTP audio";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+int lk_replay(const char *path, double speed) {
+  auto file = fopen(path, "rb");
+  if (file == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to open recording %s", path);
+    return 1;
+  }
+
+  char magic[RECORDER_MAGIC_SIZE];
+  if (fread(magic, 1, RECORDER_MAGIC_SIZE, file) != RECORDER_MAGIC_SIZE ||
+      memcmp(magic, RECORDER_MAGIC, RECORDER_MAGIC_SIZE) != 0) {
+    ESP_LOGE(LOG_TAG, "%s is not a recording", path);
+    fclose(file);
+    return 1;
+  }
+
+  if (g_mutex == NULL) {
+    g_mutex = xSemaphoreCreateMutex();
+  }
+
+  uint32_t count[LK_RECORD_TYPE_MAX] = {0};
+  uint32_t signal_failures = 0;
+  int64_t total_us[LK_RECORD_TYPE_MAX] = {0};
+  int64_t max_us[LK_RECORD_TYPE_MAX] = {0};
+
+  auto buffer = (uint8_t *)malloc(RECORDER_MAX_RECORD_SIZE);
+  auto start = esp_timer_get_time();
+  int64_t recorded_at_us = 0;
+  int result = 0;
+
+  int type;
+  while ((type = fgetc(file)) != EOF) {
+    uint64_t delta_us, len;
+    if (!lk_read_varint(file, &delta_us) || !lk_read_varint(file, &len) ||
+        len > RECORDER_MAX_RECORD_SIZE || fread(buffer, 1, len, file) != len ||
+        type <= 0 || type >= LK_RECORD_TYPE_MAX) {
+      ESP_LOGE(LOG_TAG, "Truncated or corrupt record in %s", path);
+      result = 1;
+      break;
+    }
+
+    // speed of 0 replays as fast as possible
+    recorded_at_us += delta_us;
+    if (speed > 0) {
+      auto due = start + (int64_t)(recorded_at_us / speed);
+      auto now = esp_timer_get_time();
+      if (due > now) {
+        vTaskDelay(pdMS_TO_TICKS((due - now) / 1000));
+      }
+    }
+
+    auto handler_start = esp_timer_get_time();
+    switch (type) {
+      case LK_RECORD_SIGNAL_RESPONSE:
+        if (!lk_websocket_handle_signal_message(buffer, len)) {
+          signal_failures++;
+        }
+        lk_replay_drain_signaling();
+        break;
+      case LK_RECORD_RTP_AUDIO:
+        if (len > RTP_HEADER_SIZE) {
+          lk_subscriber_on_audio_track(buffer + RTP_HEADER_SIZE,
+                                       len - RTP_HEADER_SIZE);
+        }
+        break;
+      case LK_RECORD_SIGNAL_REQUEST:
+        // Outgoing, nothing to drive
+        break;
+    }
+    auto elapsed = esp_timer_get_time() - handler_start;
+
+    count[type]++;
+    total_us[type] += elapsed;
+    if (elapsed > max_us[type]) {
+      max_us[type] = elapsed;
+    }
+  }
+
+  free(buffer);
+  fclose(file);
+
+  ESP_LOGI(LOG_TAG, "Replayed %s in %lldms", path,
+           (long long)((esp_timer_get_time() - start) / 1000));
+  for (int i = 1; i < LK_RECORD_TYPE_MAX; i++) {
+    ESP_LOGI(LOG_TAG, "%-16s count=%lu avg=%lldus max=%lldus",
+             lk_record_type_to_string(i), (unsigned long)count[i],
+             (long long)(count[i] ? total_us[i] / count[i] : 0),
+             (long long)max_us[i]);
+  }
+  lk_audio_decoder_log_stats();
+
+  // Lets CI catch handlers that no longer accept what they used to
+  if (signal_failures != 0 || audio_decode_errors != 0) {
+    ESP_LOGE(LOG_TAG, "Replay failed: %lu SignalResponse and %lu Opus errors",
+             (unsigned long)signal_failures,
+             (unsigned long)audio_decode_errors);
+    result = 1;
+  }
+
+  return result;
+}
+
+#ifdef LINUX_BUILD
+// A short call that exercises every replayed path without a server: JOIN,
+// OFFER, TRICKLE, SPEAKERS_CHANGED and UPDATE, then a 440Hz tone with single
+// and burst losses (FEC and PLC), a duplicate, a reordered packet and a switch
+// to a new SSRC and sequence number like a republish
+#define SYNTHETIC_DURATION_MS 10000
+#define SYNTHETIC_PACKET_MS 20
+#define SYNTHETIC_PACKET_SAMPLES (SAMPLE_RATE * SYNTHETIC_PACKET_MS / 1000)
+#define SYNTHETIC_RTP_CLOCK_RATE 48000
+#define SYNTHETIC_SSRC 0x4C4B5331
+#define SYNTHETIC_REPUBLISH_SSRC 0x4C4B5332
+#define SYNTHETIC_REPUBLISH_PACKET 450
+#define SYNTHETIC_PAYLOAD_TYPE 111
+#define SYNTHETIC_AUDIO_LEVEL_EXTENSION_ID 1
+#define SYNTHETIC_AUDIO_LEVEL_DBOV 30
+#define SYNTHETIC_MAX_PACKET_SIZE 1500
+
+static const char *SYNTHETIC_OFFER_SDP =
+    "v=0\r\n"
+    "o=- 1 2 IN IP4 127.0.0.1\r\n"
+    "s=-\r\n"
+    "t=0 0\r\n"
+    "a=group:BUNDLE 0\r\n"
+    "m=audio 9 UDP/TLS/RTP/SAVPF 111\r\n"
+    "c=IN IP4 0.0.0.0\r\n"
+    "a=ice-ufrag:synthetic\r\n"
+    "a=ice-pwd:synthetic-synthetic-synthetic\r\n"
+    "a=mid:0\r\n"
+    "a=sendonly\r\n"
+    "a=extmap:1 urn:ietf:params:rtp-hdrext:ssrc-audio-level\r\n"
+    "a=rtpmap:111 opus/48000/2\r\n"
+    "a=fmtp:111 minptime=10;useinbandfec=1\r\n";
+
+static const char *SYNTHETIC_CANDIDATE =
+    "{\"candidate\":\"candidate:1 1 udp 2130706431 192.0.2.1 50000 typ "
+    "host\",\"sdpMid\":\"0\",\"sdpMLineIndex\":0}";
+
+static void lk_synthetic_write_response(Livekit__SignalResponse *response,
+                                        int64_t at_us) {
+  auto size = livekit__signal_response__get_packed_size(response);
+  auto buffer = (uint8_t *)malloc(size);
+  livekit__signal_response__pack(response, buffer);
+  lk_recorder_write_at(LK_RECORD_SIGNAL_RESPONSE, buffer, size, at_us);
+  free(buffer);
+}
+
+static void lk_synthetic_write_speaking(int64_t at_us) {
+  Livekit__SpeakerInfo speaker = LIVEKIT__SPEAKER_INFO__INIT;
+  speaker.sid = (char *)"PA_synthetic_remote";
+  speaker.level = 0.5;
+  speaker.active = true;
+  Livekit__SpeakerInfo *speakers[] = {&speaker};
+
+  Livekit__SpeakersChanged changed = LIVEKIT__SPEAKERS_CHANGED__INIT;
+  changed.n_speakers = 1;
+  changed.speakers = speakers;
+
+  Livekit__SignalResponse response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_SPEAKERS_CHANGED;
+  response.speakers_changed = &changed;
+  lk_synthetic_write_response(&response, at_us);
+}
+
+// The remote leaves while still speaking
+static void lk_synthetic_write_leave(int64_t at_us) {
+  Livekit__ParticipantInfo remote = LIVEKIT__PARTICIPANT_INFO__INIT;
+  remote.sid = (char *)"PA_synthetic_remote";
+  remote.identity = (char *)"synthetic-remote";
+  remote.state = LIVEKIT__PARTICIPANT_INFO__STATE__DISCONNECTED;
+  Livekit__ParticipantInfo *participants[] = {&remote};
+
+  Livekit__ParticipantUpdate update = LIVEKIT__PARTICIPANT_UPDATE__INIT;
+  update.n_participants = 1;
+  update.participants = participants;
+
+  Livekit__SignalResponse response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_UPDATE;
+  response.update = &update;
+  lk_synthetic_write_response(&response, at_us);
+}
+
+static void lk_synthetic_write_signaling(int64_t at_us) {
+  Livekit__TrackInfo track = LIVEKIT__TRACK_INFO__INIT;
+  track.sid = (char *)"TR_synthetic_audio";
+  track.type = LIVEKIT__TRACK_TYPE__AUDIO;
+  track.name = (char *)"microphone";
+  Livekit__TrackInfo *tracks[] = {&track};
+
+  Livekit__ParticipantInfo remote = LIVEKIT__PARTICIPANT_INFO__INIT;
+  remote.sid = (char *)"PA_synthetic_remote";
+  remote.identity = (char *)"synthetic-remote";
+  remote.state = LIVEKIT__PARTICIPANT_INFO__STATE__ACTIVE;
+  remote.metadata = (char *)"{\"dropped before unpacking\":true}";
+  remote.n_tracks = 1;
+  remote.tracks = tracks;
+  Livekit__ParticipantInfo *others[] = {&remote};
+
+  Livekit__ParticipantInfo local = LIVEKIT__PARTICIPANT_INFO__INIT;
+  local.sid = (char *)"PA_synthetic_local";
+  local.identity = (char *)"synthetic-local";
+  local.state = LIVEKIT__PARTICIPANT_INFO__STATE__ACTIVE;
+
+  Livekit__JoinResponse join = LIVEKIT__JOIN_RESPONSE__INIT;
+  join.participant = &local;
+  join.n_other_participants = 1;
+  join.other_participants = others;
+
+  Livekit__SignalResponse response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_JOIN;
+  response.join = &join;
+  lk_synthetic_write_response(&response, at_us);
+
+  Livekit__SessionDescription offer = LIVEKIT__SESSION_DESCRIPTION__INIT;
+  offer.type = (char *)"offer";
+  offer.sdp = (char *)SYNTHETIC_OFFER_SDP;
+  response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_OFFER;
+  response.offer = &offer;
+  lk_synthetic_write_response(&response, at_us + 50000);
+
+  Livekit__TrickleRequest trickle = LIVEKIT__TRICKLE_REQUEST__INIT;
+  trickle.candidateinit = (char *)SYNTHETIC_CANDIDATE;
+  trickle.target = LIVEKIT__SIGNAL_TARGET__SUBSCRIBER;
+  response = LIVEKIT__SIGNAL_RESPONSE__INIT;
+  response.message_case = LIVEKIT__SIGNAL_RESPONSE__MESSAGE_TRICKLE;
+  response.trickle = &trickle;
+  lk_synthetic_write_response(&response, at_us + 60000);
+}
+
+static void lk_synthetic_write_rtp(const uint8_t *payload, int payload_size,
+                                   uint32_t ssrc, uint16_t sequence_number,
+                                   uint32_t timestamp, int64_t at_us) {
+  uint8_t packet[SYNTHETIC_MAX_PACKET_SIZE];
+  // Version 2 with a header extension
+  packet[0] = 0x90;
+  packet[1] = SYNTHETIC_PAYLOAD_TYPE;
+  packet[2] = sequence_number >> 8;
+  packet[3] = sequence_number & 0xFF;
+  for (int i = 0; i < 4; i++) {
+    packet[4 + i] = timestamp >> (24 - 8 * i);
+    packet[8 + i] = ssrc >> (24 - 8 * i);
+  }
+
+  // One-byte header extension with ssrc-audio-level, padded to a word
+  uint8_t extension[] = {0xBE,
+                         0xDE,
+                         0x00,
+                         0x01,
+                         SYNTHETIC_AUDIO_LEVEL_EXTENSION_ID << 4,
+                         SYNTHETIC_AUDIO_LEVEL_DBOV,
+                         0x00,
+                         0x00};
+  memcpy(packet + RTP_HEADER_SIZE, extension, sizeof(extension));
+  memcpy(packet + RTP_HEADER_SIZE + sizeof(extension), payload, payload_size);
+  lk_recorder_write_at(LK_RECORD_RTP_AUDIO, packet,
+                       RTP_HEADER_SIZE + sizeof(extension) + payload_size,
+                       at_us);
+}
+
+int lk_record_synthetic(const char *path) {
+  lk_recorder_start(path);
+  if (recorder_file == NULL) {
+    return 1;
+  }
+
+  int encoder_error = 0;
+  auto encoder = opus_encoder_create(SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP,
+                                     &encoder_error);
+  if (encoder_error != OPUS_OK) {
+    ESP_LOGE(LOG_TAG, "Failed to create OPUS encoder");
+    return 1;
+  }
+  opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(1));
+  opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(10));
+
+  int64_t at_us = recorder_last_record_us;
+  lk_synthetic_write_signaling(at_us);
+  at_us += 100000;
+  lk_synthetic_write_speaking(at_us);
+
+  const int packet_count = SYNTHETIC_DURATION_MS / SYNTHETIC_PACKET_MS;
+  opus_int16 pcm[SYNTHETIC_PACKET_SAMPLES];
+  uint8_t payloads[2][SYNTHETIC_MAX_PACKET_SIZE];
+  int payload_sizes[2] = {0};
+  uint32_t ssrc = SYNTHETIC_SSRC;
+  uint16_t sequence_number = 1000;
+  uint32_t timestamp = 12345;
+
+  for (int i = 0; i < packet_count; i++) {
+    for (int j = 0; j < SYNTHETIC_PACKET_SAMPLES; j++) {
+      auto t = (double)(i * SYNTHETIC_PACKET_SAMPLES + j) / SAMPLE_RATE;
+      pcm[j] = (opus_int16)(8000 * sin(2 * M_PI * 440 * t));
+    }
+
+    auto payload = payloads[i % 2];
+    if (i == SYNTHETIC_REPUBLISH_PACKET) {
+      ssrc = SYNTHETIC_REPUBLISH_SSRC;
+      sequence_number = 200;
+      timestamp = 987654;
+    }
+
+    payload_sizes[i % 2] =
+        opus_encode(encoder, pcm, SYNTHETIC_PACKET_SAMPLES, payload,
+                    SYNTHETIC_MAX_PACKET_SIZE - RTP_HEADER_SIZE - 8);
+    at_us += SYNTHETIC_PACKET_MS * 1000;
+
+    // Single losses are recovered with FEC, the burst needs PLC as well
+    auto lost = i % 50 == 25 || (i >= 200 && i < 203);
+    // Packet 401 arrives before 400, which then arrives late
+    if (i == 400) {
+      lost = true;
+    } else if (i == 401) {
+      lk_synthetic_write_rtp(payload, payload_sizes[1], ssrc, sequence_number,
+                             timestamp, at_us);
+      lk_synthetic_write_rtp(payloads[0], payload_sizes[0], ssrc,
+                             sequence_number - 1,
+                             timestamp - SYNTHETIC_RTP_CLOCK_RATE *
+                                             SYNTHETIC_PACKET_MS / 1000,
+                             at_us);
+      lost = true;
+    }
+
+    if (!lost && payload_sizes[i % 2] > 0) {
+      lk_synthetic_write_rtp(payload, payload_sizes[i % 2], ssrc,
+                             sequence_number, timestamp, at_us);
+      if (i == 300) {
+        lk_synthetic_write_rtp(payload, payload_sizes[i % 2], ssrc,
+                               sequence_number, timestamp, at_us);
+      }
+    }
+
+    sequence_number++;
+    timestamp += SYNTHETIC_RTP_CLOCK_RATE * SYNTHETIC_PACKET_MS / 1000;
+  }
+
+  lk_synthetic_write_leave(at_us);
+  opus_encoder_destroy(encoder);
+
+  fclose(recorder_file);
+  recorder_file = NULL;
+  ESP_LOGI(LOG_TAG, "Wrote %d ms of synthetic audio to %s",
+           SYNTHETIC_DURATION_MS, path);
+  return 0;
+}
+#endif
@@ -0,0 +1,372 @@
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <livekit_rtc.pb-c.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "main.h"
+
+#define ROOM_MAX_SPEAKERS 8
+#define ROOM_MAX_PARTICIPANT_PREFERENCES 8
+#define ROOM_SID_SIZE 32
+#define ROOM_IDENTITY_SIZE 64
+
+// Subscription preference set through lk_set_*_subscribed
+#define ROOM_PREFERENCE_AUTO 0
+#define ROOM_PREFERENCE_SUBSCRIBE 1
+#define ROOM_PREFERENCE_UNSUBSCRIBE 2
+// Track priorities run from 0 to this, see lk_room_track_priority
+#define ROOM_LOWEST_PRIORITY 4
+
+// Remote tracks, active speakers and subscription preferences. All guarded by
+// g_mutex. Other tasks read the summaries below without locking
+typedef struct {
+  char sid[ROOM_SID_SIZE];
+  char participant_sid[ROOM_SID_SIZE];
+  char participant_identity[ROOM_IDENTITY_SIZE];
+  Livekit__TrackType type;
+  bool muted;
+  bool seen;
+  int preference;
+  // What the server was last told. With LK_AUTO_SUBSCRIBE this is whether
+  // the track is enabled, otherwise whether it is subscribed
+  bool subscribed;
+} lk_remote_track_t;
+
+typedef struct {
+  char identity[ROOM_IDENTITY_SIZE];
+  int preference;
+} lk_participant_preference_t;
+
+extern SemaphoreHandle_t g_mutex;
+
+lk_remote_track_t room_tracks[ROOM_MAX_TRACKS];
+int room_track_count = 0;
+lk_participant_preference_t
+    room_participant_preferences[ROOM_MAX_PARTICIPANT_PREFERENCES];
+int room_participant_preference_count = 0;
+char room_speakers[ROOM_MAX_SPEAKERS][ROOM_SID_SIZE];
+int room_speaker_count = 0;
+char room_local_participant_sid[ROOM_SID_SIZE] = {0};
+// Our published microphone track, and whether the server asked for it to be
+// muted. room_local_mute_pending is set until the change is confirmed
+char room_local_track_sid[ROOM_SID_SIZE] = {0};
+bool room_local_muted = false;
+bool room_local_mute_pending = false;
+
+// Summaries of the above, read without locking from the audio path
+volatile bool room_remote_audio_unmuted = false;
+volatile bool room_remote_speaking = false;
+
+static int lk_room_find_speaker(const char *sid) {
+  for (int i = 0; i < room_speaker_count; i++) {
+    if (strcmp(room_speakers[i], sid) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void lk_room_update_summary() {
+  bool unmuted = false;
+  for (int i = 0; i < room_track_count; i++) {
+    if (room_tracks[i].type == LIVEKIT__TRACK_TYPE__AUDIO &&
+        room_tracks[i].subscribed && !room_tracks[i].muted) {
+      unmuted = true;
+      break;
+    }
+  }
+
+  if (unmuted != room_remote_audio_unmuted) {
+    ESP_LOGI(LOG_TAG, "Remote audio %s", unmuted ? "unmuted" : "all muted");
+  }
+  room_remote_audio_unmuted = unmuted;
+
+  // Speakers we don't receive audio from can't keep playout awake
+  bool speaking = false;
+  for (int i = 0; i < room_track_count && !speaking; i++) {
+    speaking = room_tracks[i].type == LIVEKIT__TRACK_TYPE__AUDIO &&
+               room_tracks[i].subscribed &&
+               lk_room_find_speaker(room_tracks[i].participant_sid) != -1;
+  }
+  room_remote_speaking = speaking;
+}
+
+static lk_remote_track_t *lk_room_find_track(const char *sid) {
+  for (int i = 0; i < room_track_count; i++) {
+    if (strcmp(room_tracks[i].sid, sid) == 0) {
+      return &room_tracks[i];
+    }
+  }
+  return NULL;
+}
+
+static int lk_room_participant_preference(const char *identity) {
+  for (int i = 0; i < room_participant_preference_count; i++) {
+    if (strcmp(room_participant_preferences[i].identity, identity) == 0) {
+      return room_participant_preferences[i].preference;
+    }
+  }
+  return ROOM_PREFERENCE_AUTO;
+}
+
+// Lower is picked first. Among automatic tracks active speakers come first,
+// and the track already received is kept until someone else speaks
+static int lk_room_track_priority(lk_remote_track_t *track) {
+  if (track->type != LIVEKIT__TRACK_TYPE__AUDIO ||
+      track->preference == ROOM_PREFERENCE_UNSUBSCRIBE) {
+    return -1;
+  } else if (track->preference == ROOM_PREFERENCE_SUBSCRIBE) {
+    return 0;
+  }
+
+  auto speaking = lk_room_find_speaker(track->participant_sid) != -1;
+  if (speaking) {
+    return track->subscribed ? 1 : 2;
+  }
+  return track->subscribed ? 3 : ROOM_LOWEST_PRIORITY;
+}
+
+// Only audio can be played. Ties are broken by publish order, up to
+// MAX_SUBSCRIBED_TRACKS
+static void lk_room_select_tracks(bool *desired) {
+  int selected = 0;
+  for (int i = 0; i < room_track_count; i++) {
+    desired[i] = false;
+  }
+  for (int priority = 0; priority <= ROOM_LOWEST_PRIORITY; priority++) {
+    for (int i = 0; i < room_track_count; i++) {
+      if (lk_room_track_priority(&room_tracks[i]) == priority &&
+          selected < MAX_SUBSCRIBED_TRACKS) {
+        desired[i] = true;
+        selected++;
+      }
+    }
+  }
+}
+
+// Keeps the rest in publish order
+static void lk_room_remove_track(int index) {
+  room_track_count--;
+  memmove(&room_tracks[index], &room_tracks[index + 1],
+          (room_track_count - index) * sizeof(room_tracks[0]));
+}
+
+static void lk_room_remove_speaker(const char *sid) {
+  auto index = lk_room_find_speaker(sid);
+  if (index != -1) {
+    room_speaker_count--;
+    memcpy(room_speakers[index], room_speakers[room_speaker_count],
+           ROOM_SID_SIZE);
+  }
+}
+
+// ParticipantInfo always carries the participant's full track list, so any
+// track of theirs not in it has been unpublished
+static void lk_room_update_participant(Livekit__ParticipantInfo *participant) {
+  if (strcmp(participant->sid, room_local_participant_sid) == 0) {
+    return;
+  }
+
+  for (int i = 0; i < room_track_count; i++) {
+    if (strcmp(room_tracks[i].participant_sid, participant->sid) == 0) {
+      room_tracks[i].seen = false;
+    }
+  }
+
+  if (participant->state != LIVEKIT__PARTICIPANT_INFO__STATE__DISCONNECTED) {
+    for (size_t i = 0; i < participant->n_tracks; i++) {
+      auto info = participant->tracks[i];
+      auto track = lk_room_find_track(info->sid);
+      if (track == NULL) {
+        if (room_track_count == ROOM_MAX_TRACKS) {
+          ESP_LOGI(LOG_TAG, "Too many remote tracks, ignoring %s", info->sid);
+          continue;
+        }
+        track = &room_tracks[room_track_count++];
+        memset(track, 0, sizeof(*track));
+        strncpy(track->sid, info->sid, ROOM_SID_SIZE - 1);
+        strncpy(track->participant_sid, participant->sid, ROOM_SID_SIZE - 1);
+        strncpy(track->participant_identity, participant->identity,
+                ROOM_IDENTITY_SIZE - 1);
+        track->type = info->type;
+        track->preference =
+            lk_room_participant_preference(participant->identity);
+        track->subscribed = LK_AUTO_SUBSCRIBE;
+      }
+      track->muted = info->muted;
+      track->seen = true;
+    }
+  }
+
+  for (int i = room_track_count - 1; i >= 0; i--) {
+    if (!room_tracks[i].seen &&
+        strcmp(room_tracks[i].participant_sid, participant->sid) == 0) {
+      lk_room_remove_track(i);
+    }
+  }
+
+  // Nobody sends SpeakersChanged for a participant that left mid sentence
+  if (participant->state == LIVEKIT__PARTICIPANT_INFO__STATE__DISCONNECTED) {
+    lk_room_remove_speaker(participant->sid);
+  }
+}
+
+void lk_room_handle_join(Livekit__JoinResponse *join) {
+  room_track_count = 0;
+  room_speaker_count = 0;
+  if (join->participant != NULL) {
+    strncpy(room_local_participant_sid, join->participant->sid,
+            ROOM_SID_SIZE - 1);
+  }
+
+  for (size_t i = 0; i < join->n_other_participants; i++) {
+    lk_room_update_participant(join->other_participants[i]);
+  }
+  lk_room_update_summary();
+}
+
+void lk_room_handle_participant_update(Livekit__ParticipantUpdate *update) {
+  for (size_t i = 0; i < update->n_participants; i++) {
+    lk_room_update_participant(update->participants[i]);
+  }
+  lk_room_update_summary();
+}
+
+void lk_room_handle_track_published(
+    Livekit__TrackPublishedResponse *published) {
+  if (published->track != NULL) {
+    strncpy(room_local_track_sid, published->track->sid, ROOM_SID_SIZE - 1);
+  }
+}
+
+// The server muting our own published track. Remote mutes arrive as
+// ParticipantUpdate instead
+void lk_room_handle_mute(Livekit__MuteTrackRequest *mute) {
+  if (strcmp(mute->sid, room_local_track_sid) != 0) {
+    ESP_LOGI(LOG_TAG, "Mute for unknown track %s", mute->sid);
+    return;
+  }
+
+  ESP_LOGI(LOG_TAG, "Server %s our microphone",
+           mute->muted ? "muted" : "unmuted");
+  room_local_muted = mute->muted;
+  room_local_mute_pending = true;
+#ifndef LINUX_BUILD
+  lk_audio_set_capture_muted(mute->muted);
+#endif
+}
+
+// SpeakersChanged only carries speakers whose state changed
+void lk_room_handle_speakers_changed(Livekit__SpeakersChanged *changed) {
+  for (size_t i = 0; i < changed->n_speakers; i++) {
+    auto speaker = changed->speakers[i];
+    if (strcmp(speaker->sid, room_local_participant_sid) == 0) {
+      continue;
+    }
+
+    if (!speaker->active) {
+      lk_room_remove_speaker(speaker->sid);
+    } else if (lk_room_find_speaker(speaker->sid) == -1 &&
+               room_speaker_count < ROOM_MAX_SPEAKERS) {
+      strncpy(room_speakers[room_speaker_count], speaker->sid,
+              ROOM_SID_SIZE - 1);
+      room_speakers[room_speaker_count][ROOM_SID_SIZE - 1] = '\0';
+      room_speaker_count++;
+    }
+  }
+  lk_room_update_summary();
+}
+
+// Fills sids with tracks whose subscription (or enabled state, with
+// LK_AUTO_SUBSCRIBE) needs changing to `subscribe`, and assumes it is sent.
+// Must be called with g_mutex held
+int lk_room_take_subscription_changes(bool subscribe, char **sids) {
+  bool desired[ROOM_MAX_TRACKS];
+  lk_room_select_tracks(desired);
+
+  int count = 0;
+  for (int i = 0; i < room_track_count; i++) {
+    if (desired[i] == subscribe && room_tracks[i].subscribed != subscribe) {
+      room_tracks[i].subscribed = subscribe;
+      sids[count++] = room_tracks[i].sid;
+    }
+  }
+
+  if (count != 0) {
+    lk_room_update_summary();
+  }
+  return count;
+}
+
+void lk_set_participant_subscribed(const char *identity, bool subscribe) {
+  if (xSemaphoreTake(g_mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+
+  auto preference =
+      subscribe ? ROOM_PREFERENCE_SUBSCRIBE : ROOM_PREFERENCE_UNSUBSCRIBE;
+  int i = 0;
+  while (i < room_participant_preference_count &&
+         strcmp(room_participant_preferences[i].identity, identity) != 0) {
+    i++;
+  }
+
+  if (i < ROOM_MAX_PARTICIPANT_PREFERENCES) {
+    strncpy(room_participant_preferences[i].identity, identity,
+            ROOM_IDENTITY_SIZE - 1);
+    room_participant_preferences[i].preference = preference;
+    room_participant_preference_count =
+        MAX(room_participant_preference_count, i + 1);
+  } else {
+    ESP_LOGI(LOG_TAG, "Too many participant preferences, only applying to "
+                      "current tracks of %s",
+             identity);
+  }
+
+  for (int j = 0; j < room_track_count; j++) {
+    if (strcmp(room_tracks[j].participant_identity, identity) == 0) {
+      room_tracks[j].preference = preference;
+    }
+  }
+
+  xSemaphoreGive(g_mutex);
+}
+
+void lk_set_track_subscribed(const char *track_sid, bool subscribe) {
+  if (xSemaphoreTake(g_mutex, portMAX_DELAY) != pdTRUE) {
+    return;
+  }
+
+  auto track = lk_room_find_track(track_sid);
+  if (track == NULL) {
+    ESP_LOGI(LOG_TAG, "Can't subscribe to unknown track %s", track_sid);
+  } else {
+    track->preference =
+        subscribe ? ROOM_PREFERENCE_SUBSCRIBE : ROOM_PREFERENCE_UNSUBSCRIBE;
+  }
+
+  xSemaphoreGive(g_mutex);
+}
+
+// Returns whether a server mute of our track still needs confirming with a
+// MuteTrackRequest. Must be called with g_mutex held
+bool lk_room_take_local_mute_change(char **track_sid, bool *muted) {
+  if (!room_local_mute_pending) {
+    return false;
+  }
+
+  room_local_mute_pending = false;
+  *track_sid = room_local_track_sid;
+  *muted = room_local_muted;
+  return true;
+}
+
+bool lk_room_remote_audio_unmuted() {
+  return room_remote_audio_unmuted;
+}
+
+bool lk_room_remote_speaking() {
+  return room_remote_speaking;
+}
@@ -1,19 +1,51 @@
-#ifndef LINUX_BUILD
-#include <driver/i2s.h>
-#include <opus.h>
-#endif
-
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <math.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include "main.h"
 
-#define SUBSCRIBER_TICK_INTERVAL 15
-#define PUBLISHER_TICK_INTERVAL 15
+// libpeer doesn't expose its sockets to wait on, so PeerConnection tasks
+// sleep until just after the next media packet is due, and are woken early by
+// signaling. While not connected they tick at PEER_HANDSHAKE_TICK_MS for
+// ICE/DTLS. A packet that is late is polled for at PEER_POLL_TICK_MS for up to
+// PEER_MEDIA_LATE_US, after that the task ticks at PEER_IDLE_TICK_MS, one
+// packet duration, so the first packet of a talk spurt waits at most that
+// long. Timeouts are rounded up to whole FreeRTOS ticks, 10ms at the default
+// 100Hz. Define PEER_CONNECTION_FIXED_TICK_MS to compare against a fixed tick
+#define PEER_HANDSHAKE_TICK_MS 5
+#define PEER_POLL_TICK_MS 2
+#define PEER_IDLE_TICK_MS OPUS_RECEIVE_PTIME_MS
+// Wake this long after the next media packet is expected
+#define PEER_MEDIA_SLACK_US 1000
+#define PEER_MEDIA_LATE_US 6000
+#define PEER_MIN_MEDIA_INTERVAL_US 5000
+#define PEER_MAX_MEDIA_INTERVAL_US (OPUS_MAX_PACKET_DURATION_MS * 1000)
+#define ENCODER_TASK_STACK_SIZE 20000
+#define ENCODER_TASK_PRIORITY 8
+
+// peer_connection_loop reads one packet per call. Call it again while it is
+// still finding media, up to this many times
+#define PEER_MAX_DRAIN 16
 
 // 20ms samples
 #define OPUS_OUT_BUFFER_SIZE 3840  // 1276 bytes is recommended by opus_encode
+
+#define OPUS_RTP_CLOCK_RATE 48000
+// Sequence jumps past these (RFC 3550 A.1) are a new stream, not reordering
+// or loss
+#define RTP_MAX_MISORDER 100
+#define RTP_MAX_DROPOUT 3000
+#define STATS_REPORT_INTERVAL_US (10 * 1000 * 1000)
+
+// ssrc-audio-level is -dBov, 127 is silence. Anything quieter than this is
+// treated as silence
+#define IDLE_AUDIO_LEVEL_DBOV 60
+// How long after the last voice packet playout is kept running
+#define IDLE_HANGOVER_US (500 * 1000)
+
 extern SemaphoreHandle_t g_mutex;
 
 char *subscriber_offer_buffer = NULL;
@@ -24,6 +56,8 @@ char *ice_candidate_buffer = NULL;
 char *subscriber_answer_ice_ufrag = NULL;
 char *subscriber_answer_ice_pwd = NULL;
 char *subscriber_answer_fingerprint = NULL;
+// Header extension id the remote offered for ssrc-audio-level, 0 if none
+int subscriber_audio_level_extension_id = 0;
 
 // publisher_status is a FSM of the following states
 // * 0 - NoOp
@@ -37,6 +71,322 @@ char *publisher_signaling_buffer = NULL;
 PeerConnection *subscriber_peer_connection = NULL;
 PeerConnection *publisher_peer_connection = NULL;
 
+// Receive side RTP statistics, only touched from the subscriber task
+uint32_t rtp_packets_received = 0;
+int64_t rtp_last_arrival_us = 0;
+uint32_t rtp_last_timestamp = 0;
+uint16_t rtp_last_sequence_number = 0;
+uint32_t rtp_ssrc = 0;
+// The current packet started a new stream, so it has no predecessor to
+// compare against
+bool rtp_stream_restarted = false;
+uint32_t rtp_stream_restarts = 0;
+uint32_t rtp_packets_lost = 0;
+uint32_t rtp_packets_late = 0;
+int64_t rtp_max_interarrival_us = 0;
+// RFC 3550 interarrival jitter, in RTP clock units
+double rtp_jitter = 0;
+int64_t stats_last_report_us = 0;
+
+// Decoding and I2S output are idled while no remote participant is speaking
+bool playout_idle = false;
+int64_t playout_state_since_us = 0;
+int64_t playout_last_voice_us = 0;
+// Time spent idle in the current stats window
+int64_t playout_idle_us = 0;
+
+typedef struct {
+  SemaphoreHandle_t wakeup;
+  int64_t last_wakeup_us;
+  int64_t last_media_us;
+  // Smoothed interval between wakeups that found media
+  int64_t media_interval_us;
+  uint32_t wakeups;
+  uint32_t media_wakeups;
+  // Time since the previous wakeup, summed over wakeups that found media. An
+  // upper bound on how long received packets waited to be read
+  int64_t media_wait_us;
+} lk_peer_loop_t;
+
+lk_peer_loop_t subscriber_loop = {};
+lk_peer_loop_t publisher_loop = {};
+
+extern bool lk_room_remote_audio_unmuted();
+extern bool lk_room_remote_speaking();
+
+// libpeer passes onaudiotrack the payload that directly follows the fixed RTP
+// header, so header fields are read back from just before it
+static uint32_t lk_rtp_timestamp(uint8_t *payload) {
+  uint8_t *header = payload - RTP_HEADER_SIZE;
+  return ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) |
+         ((uint32_t)header[6] << 8) | (uint32_t)header[7];
+}
+
+static uint16_t lk_rtp_sequence_number(uint8_t *payload) {
+  uint8_t *header = payload - RTP_HEADER_SIZE;
+  return ((uint16_t)header[2] << 8) | (uint16_t)header[3];
+}
+
+static uint32_t lk_rtp_ssrc(uint8_t *payload) {
+  uint8_t *header = payload - RTP_HEADER_SIZE;
+  return ((uint32_t)header[8] << 24) | ((uint32_t)header[9] << 16) |
+         ((uint32_t)header[10] << 8) | (uint32_t)header[11];
+}
+
+// Returns how many packets were lost before this one, or -1 if this packet is
+// a duplicate or arrived after a later packet was already played. A new SSRC
+// or a sequence jump beyond RTP_MAX_MISORDER/RTP_MAX_DROPOUT (republish,
+// subscription swap) restarts tracking instead
+static int lk_rtp_lost_packets(uint8_t *payload) {
+  auto sequence_number = lk_rtp_sequence_number(payload);
+  auto ssrc = lk_rtp_ssrc(payload);
+  auto delta = (int16_t)(sequence_number - rtp_last_sequence_number);
+
+  rtp_stream_restarted = rtp_packets_received == 0 || ssrc != rtp_ssrc ||
+                         delta < -RTP_MAX_MISORDER || delta > RTP_MAX_DROPOUT;
+  if (rtp_stream_restarted) {
+    if (rtp_packets_received != 0) {
+      ESP_LOGI(LOG_TAG, "RTP stream restarted, ssrc=%08lx seq=%u",
+               (unsigned long)ssrc, sequence_number);
+      rtp_stream_restarts++;
+      lk_audio_decoder_reset();
+    }
+    rtp_ssrc = ssrc;
+    rtp_last_sequence_number = sequence_number;
+    return 0;
+  }
+
+  if (delta <= 0) {
+    rtp_packets_late++;
+    return -1;
+  }
+
+  rtp_last_sequence_number = sequence_number;
+  rtp_packets_lost += delta - 1;
+  return delta - 1;
+}
+
+// libpeer only strips the fixed header. Skip CSRCs, header extensions and
+// padding, picking out the ssrc-audio-level extension on the way. Returns
+// false if the packet is malformed
+static bool lk_rtp_strip_header(uint8_t **payload, size_t *size,
+                                int *audio_level) {
+  uint8_t *header = *payload - RTP_HEADER_SIZE;
+  size_t offset = (header[0] & 0x0F) * 4;
+  size_t len = *size;
+  *audio_level = -1;
+
+  if (header[0] & 0x20) {
+    if (len == 0 || (*payload)[len - 1] > len) {
+      return false;
+    }
+    len -= (*payload)[len - 1];
+  }
+
+  if (header[0] & 0x10) {
+    if (offset + 4 > len) {
+      return false;
+    }
+
+    uint8_t *extension = *payload + offset;
+    uint16_t profile = ((uint16_t)extension[0] << 8) | extension[1];
+    size_t extension_len =
+        (((size_t)extension[2] << 8) | (size_t)extension[3]) * 4;
+    offset += 4;
+    if (offset + extension_len > len) {
+      return false;
+    }
+
+    // One-byte header extensions (RFC 8285)
+    uint8_t *elements = extension + 4;
+    for (size_t i = 0; profile == 0xBEDE && i < extension_len;) {
+      int id = elements[i] >> 4;
+      size_t element_len = (elements[i] & 0x0F) + 1;
+      if (id == 0) {
+        i++;
+        continue;
+      } else if (id == 15 || i + 1 + element_len > extension_len) {
+        break;
+      }
+
+      if (id == subscriber_audio_level_extension_id) {
+        *audio_level = elements[i + 1] & 0x7F;
+      }
+      i += 1 + element_len;
+    }
+    offset += extension_len;
+  }
+
+  if (offset > len) {
+    return false;
+  }
+
+  *payload += offset;
+  *size = len - offset;
+  return true;
+}
+
+static void lk_set_playout_idle(bool idle) {
+  if (idle == playout_idle) {
+    return;
+  }
+
+  auto now = esp_timer_get_time();
+  if (playout_idle) {
+    playout_idle_us += now - playout_state_since_us;
+  }
+  playout_state_since_us = now;
+  playout_idle = idle;
+  ESP_LOGD(LOG_TAG, "Playout %s", idle ? "idle" : "resumed");
+
+#ifndef LINUX_BUILD
+  lk_audio_set_idle(idle);
+#endif
+}
+
+// Muted tracks stop sending, so idling can't only be driven by packets
+static void lk_update_playout_idle() {
+  auto now = esp_timer_get_time();
+  if (now - playout_last_voice_us > IDLE_HANGOVER_US &&
+      (!lk_room_remote_audio_unmuted() || !lk_room_remote_speaking())) {
+    lk_set_playout_idle(true);
+  }
+}
+
+static void lk_peer_loop_init(lk_peer_loop_t *loop) {
+  loop->media_interval_us = OPUS_PACKET_DURATION_MS * 1000;
+  loop->last_wakeup_us = esp_timer_get_time();
+  loop->wakeup = xSemaphoreCreateBinary();
+}
+
+// Wake PeerConnection tasks early, e.g. because there is signaling to process
+void lk_peer_connection_wake() {
+  if (subscriber_loop.wakeup != NULL) {
+    xSemaphoreGive(subscriber_loop.wakeup);
+  }
+  if (publisher_loop.wakeup != NULL) {
+    xSemaphoreGive(publisher_loop.wakeup);
+  }
+}
+
+// Wake the publisher task early, e.g. because audio was queued for sending
+void lk_publisher_wake() {
+  if (publisher_loop.wakeup != NULL) {
+    xSemaphoreGive(publisher_loop.wakeup);
+  }
+}
+
+// max_timeout_ms of -1 leaves the timeout to the PeerConnection state
+static void lk_peer_loop_wait(lk_peer_loop_t *loop,
+                              PeerConnection *peer_connection, bool found_media,
+                              int max_timeout_ms) {
+  auto now = esp_timer_get_time();
+  loop->wakeups++;
+  if (found_media) {
+    loop->media_wakeups++;
+    loop->media_wait_us += now - loop->last_wakeup_us;
+    if (loop->last_media_us != 0) {
+      auto interval = MIN(MAX(now - loop->last_media_us,
+                              (int64_t)PEER_MIN_MEDIA_INTERVAL_US),
+                          (int64_t)PEER_MAX_MEDIA_INTERVAL_US);
+      loop->media_interval_us += (interval - loop->media_interval_us) / 8;
+    }
+    loop->last_media_us = now;
+  }
+
+#ifdef PEER_CONNECTION_FIXED_TICK_MS
+  int64_t timeout_ms = PEER_CONNECTION_FIXED_TICK_MS;
+#else
+  int64_t timeout_ms = PEER_IDLE_TICK_MS;
+  if (peer_connection_get_state(peer_connection) !=
+      PEER_CONNECTION_COMPLETED) {
+    timeout_ms = PEER_HANDSHAKE_TICK_MS;
+  } else if (now - loop->last_media_us <
+             loop->media_interval_us + PEER_MEDIA_LATE_US) {
+    auto next_media_us =
+        loop->last_media_us + loop->media_interval_us + PEER_MEDIA_SLACK_US;
+    // Round up, waking a tick early only costs another wakeup
+    timeout_ms = MAX((next_media_us - now + 999) / 1000,
+                     (int64_t)PEER_POLL_TICK_MS);
+  }
+#endif
+  if (max_timeout_ms >= 0) {
+    timeout_ms = MIN(timeout_ms, (int64_t)max_timeout_ms);
+  }
+
+#ifdef PEER_CONNECTION_FIXED_TICK_MS
+  // Rounded down like the vTaskDelay it replaced, 15ms is one 10ms tick
+  auto ticks = pdMS_TO_TICKS(timeout_ms);
+#else
+  // pdMS_TO_TICKS rounds down, which would turn short timeouts into busy polls
+  auto ticks = (TickType_t)MAX(
+      (timeout_ms * configTICK_RATE_HZ + 999) / 1000, (int64_t)1);
+#endif
+  xSemaphoreTake(loop->wakeup, ticks);
+  loop->last_wakeup_us = esp_timer_get_time();
+}
+
+static void lk_update_rtp_receive_stats(uint8_t *payload) {
+  auto now = esp_timer_get_time();
+  auto timestamp = lk_rtp_timestamp(payload);
+
+  if (!rtp_stream_restarted) {
+    auto arrival_delta = now - rtp_last_arrival_us;
+    auto transit_delta =
+        (double)arrival_delta * OPUS_RTP_CLOCK_RATE / 1000000 -
+        (double)(int32_t)(timestamp - rtp_last_timestamp);
+    rtp_jitter += (fabs(transit_delta) - rtp_jitter) / 16;
+    rtp_max_interarrival_us = MAX(rtp_max_interarrival_us, arrival_delta);
+  }
+
+  rtp_packets_received++;
+  rtp_last_arrival_us = now;
+  rtp_last_timestamp = timestamp;
+}
+
+static void lk_report_stats() {
+  auto now = esp_timer_get_time();
+  if (now - stats_last_report_us < STATS_REPORT_INTERVAL_US) {
+    return;
+  }
+
+  auto window_us = now - stats_last_report_us;
+  if (playout_idle) {
+    playout_idle_us += now - playout_state_since_us;
+    playout_state_since_us = now;
+  }
+  ESP_LOGI(LOG_TAG, "Playout idle: %.0f%%",
+           window_us > 0 ? 100.0 * playout_idle_us / window_us : 0.0);
+  playout_idle_us = 0;
+
+  ESP_LOGI(LOG_TAG, "Subscriber loop: wakeups=%.1f/s rx_wait<=%.1fms",
+           window_us > 0 ? 1000000.0 * subscriber_loop.wakeups / window_us
+                         : 0.0,
+           subscriber_loop.media_wakeups
+               ? subscriber_loop.media_wait_us / 1000.0 /
+                     subscriber_loop.media_wakeups
+               : 0.0);
+  subscriber_loop.wakeups = 0;
+  subscriber_loop.media_wakeups = 0;
+  subscriber_loop.media_wait_us = 0;
+
+  ESP_LOGI(LOG_TAG,
+           "RTP recv: packets=%lu lost=%lu late=%lu restarts=%lu "
+           "jitter=%.1fms max_interarrival=%lldms",
+           (unsigned long)rtp_packets_received,
+           (unsigned long)rtp_packets_lost, (unsigned long)rtp_packets_late,
+           (unsigned long)rtp_stream_restarts,
+           rtp_jitter * 1000 / OPUS_RTP_CLOCK_RATE,
+           (long long)(rtp_max_interarrival_us / 1000));
+  rtp_max_interarrival_us = 0;
+  stats_last_report_us = now;
+
+  lk_audio_decoder_log_stats();
+#ifndef LINUX_BUILD
+  lk_audio_log_stats();
+#endif
+}
+
 int get_publisher_status() {
   return publisher_status;
 }
@@ -44,6 +394,7 @@ int get_publisher_status() {
 void set_publisher_status(int status) {
   ESP_LOGI(LOG_TAG, "Setting publisher status to %d", status);
   publisher_status = status;
+  lk_peer_connection_wake();
 }
 
 static void lk_publisher_onconnectionstatechange_task(PeerConnectionState state,
@@ -91,9 +442,32 @@ static void lk_subscriber_on_icecandidate_task(char *description,
       strndup(icePwd, (int)(strchr(icePwd, '\r') - icePwd));
 }
 
+// libpeer's offer doesn't say how we packetise. Append ptime/maxptime to the
+// end of the audio section so the remote knows what to expect
+static char *lk_publisher_offer_with_ptime(const char *offer) {
+  auto audio = strstr(offer, "m=audio");
+  if (audio == NULL) {
+    return strdup(offer);
+  }
+
+  auto section_end = strstr(audio, "\r\nm=");
+  size_t insert_at =
+      section_end ? section_end + 2 - offer : strlen(offer);
+
+  char ptime[48];
+  snprintf(ptime, sizeof(ptime), "a=ptime:%d\r\na=maxptime:%d\r\n",
+           OPUS_PACKET_DURATION_MS, OPUS_PACKET_DURATION_MS);
+
+  auto result = (char *)malloc(strlen(offer) + strlen(ptime) + 1);
+  memcpy(result, offer, insert_at);
+  strcpy(result + insert_at, ptime);
+  strcat(result, offer + insert_at);
+  return result;
+}
+
 static void lk_publisher_on_icecandidate_task(char *description,
                                               void *user_data) {
-  publisher_signaling_buffer = strdup(description);
+  publisher_signaling_buffer = lk_publisher_offer_with_ptime(description);
   set_publisher_status(3);
 }
 
@@ -131,6 +505,8 @@ int lk_process_signaling_values(PeerConnection *peer_connection,
 }
 
 void lk_subscriber_peer_connection_task(void *user_data) {
+  lk_peer_loop_init(&subscriber_loop);
+
   while (1) {
     if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
       lk_process_signaling_values(subscriber_peer_connection,
@@ -139,14 +515,39 @@ void lk_subscriber_peer_connection_task(void *user_data) {
       xSemaphoreGive(g_mutex);
     }
 
-    peer_connection_loop(subscriber_peer_connection);
-    vTaskDelay(pdMS_TO_TICKS(SUBSCRIBER_TICK_INTERVAL));
+    // Late packets count as read too, so a burst is still drained past them
+    auto received_before = rtp_packets_received;
+    for (int i = 0; i < PEER_MAX_DRAIN; i++) {
+      auto received = rtp_packets_received + rtp_packets_late;
+      peer_connection_loop(subscriber_peer_connection);
+      if (rtp_packets_received + rtp_packets_late == received) {
+        break;
+      }
+    }
+
+    lk_update_playout_idle();
+    lk_report_stats();
+    lk_peer_loop_wait(&subscriber_loop, subscriber_peer_connection,
+                      rtp_packets_received != received_before, -1);
   }
 }
 
 void lk_publisher_peer_connection_task(void *user_data) {
+  lk_peer_loop_init(&publisher_loop);
+
 #ifndef LINUX_BUILD
-  lk_init_audio_encoder();
+  // Above this task so capture keeps running while a send is stuck
+  static StaticTask_t encoder_task_buffer;
+  auto encoder_stack_memory = (StackType_t *)heap_caps_malloc(
+      ENCODER_TASK_STACK_SIZE * sizeof(StackType_t), MALLOC_CAP_SPIRAM);
+  if (encoder_stack_memory) {
+    xTaskCreateStaticPinnedToCore(lk_audio_encoder_task, "lk_encoder",
+                                  ENCODER_TASK_STACK_SIZE, NULL,
+                                  ENCODER_TASK_PRIORITY, encoder_stack_memory,
+                                  &encoder_task_buffer, 0);
+  } else {
+    ESP_LOGE(LOG_TAG, "Failed to allocate audio encoder task stack");
+  }
 #endif
 
   while (1) {
@@ -165,13 +566,43 @@ void lk_publisher_peer_connection_task(void *user_data) {
       xSemaphoreGive(g_mutex);
     }
 
+    int pacer_timeout_ms = -1;
 #ifndef LINUX_BUILD
-    lk_send_audio(publisher_peer_connection);
+    pacer_timeout_ms = lk_send_audio(publisher_peer_connection);
 #endif
 
     peer_connection_loop(publisher_peer_connection);
-    vTaskDelay(pdMS_TO_TICKS(PUBLISHER_TICK_INTERVAL));
+    lk_peer_loop_wait(&publisher_loop, publisher_peer_connection, false,
+                      pacer_timeout_ms);
+  }
+}
+
+void lk_subscriber_on_audio_track(uint8_t *data, size_t size) {
+  lk_recorder_write(LK_RECORD_RTP_AUDIO, data - RTP_HEADER_SIZE,
+                    size + RTP_HEADER_SIZE);
+  auto lost_packets = lk_rtp_lost_packets(data);
+  if (lost_packets == -1) {
+    return;
+  }
+
+  // Late and duplicate packets would skew jitter with an old timestamp
+  lk_update_rtp_receive_stats(data);
+  int audio_level;
+  if (!lk_rtp_strip_header(&data, &size, &audio_level)) {
+    return;
   }
+
+  // Without the audio level extension every packet counts as voice
+  if (audio_level == -1 || audio_level <= IDLE_AUDIO_LEVEL_DBOV) {
+    playout_last_voice_us = esp_timer_get_time();
+    lk_set_playout_idle(false);
+  }
+
+  if (playout_idle) {
+    return;
+  }
+
+  lk_audio_decode(data, size, lost_packets);
 }
 
 PeerConnection *lk_create_peer_connection(int isPublisher) {
@@ -181,9 +612,7 @@ PeerConnection *lk_create_peer_connection(int isPublisher) {
       .video_codec = CODEC_NONE,
       .datachannel = isPublisher ? DATA_CHANNEL_NONE : DATA_CHANNEL_STRING,
       .onaudiotrack = [](uint8_t *data, size_t size, void *userdata) -> void {
-#ifndef LINUX_BUILD
-        lk_audio_decode(data, size);
-#endif
+        lk_subscriber_on_audio_track(data, size);
       },
       .onvideotrack = NULL,
       .on_request_keyframe = NULL,
@@ -246,6 +675,10 @@ static const char sdp_audio[] =
     "m=audio 9 UDP/TLS/RTP/SAVP 111\r\n"
     "c=IN IP4 0.0.0.0\r\n"
     "a=rtpmap:111 opus/48000/2\r\n"
+    "a=fmtp:111 minptime=10;useinbandfec=1\r\n"
+    "a=ptime:%d\r\n"
+    "a=maxptime:%d\r\n"
+    "%s"  // a=extmap for ssrc-audio-level, if offered
     "a=rtcp:9 IN IP4 0.0.0.0\r\n"
     "a=setup:passive\r\n"
     "a=mid:audio\r\n"
@@ -257,8 +690,16 @@ static const char sdp_audio[] =
 void lk_populate_answer(char *answer, size_t answer_size, int include_audio) {
   size_t ret = 0;
   if (include_audio) {
+    char extmap[80] = {0};
+    if (subscriber_audio_level_extension_id != 0) {
+      snprintf(extmap, sizeof(extmap),
+               "a=extmap:%d urn:ietf:params:rtp-hdrext:ssrc-audio-level\r\n",
+               subscriber_audio_level_extension_id);
+    }
+
     ret = snprintf(answer, answer_size, sdp_audio, subscriber_answer_ice_ufrag,
                    subscriber_answer_ice_pwd, subscriber_answer_fingerprint,
+                   OPUS_RECEIVE_PTIME_MS, OPUS_RECEIVE_PTIME_MS, extmap,
                    subscriber_answer_ice_ufrag, subscriber_answer_ice_pwd,
                    subscriber_answer_fingerprint);
   } else {
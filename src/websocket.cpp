@@ -17,8 +17,10 @@
 #include "main.h"
 
 #define WEBSOCKET_URI_SIZE 1024
-#define ANSWER_BUFFER_SIZE 1024
+#define ANSWER_BUFFER_SIZE 2048
 #define WEBSOCKET_BUFFER_SIZE 2048
+// Largest SignalResponse we are willing to reassemble
+#define SIGNAL_MESSAGE_MAX_SIZE (256 * 1024)
 #define LIVEKIT_PROTOCOL_VERSION 3
 
 static const char *SDP_TYPE_ANSWER = "answer";
@@ -43,10 +45,31 @@ extern char *subscriber_offer_buffer;
 extern char *ice_candidate_buffer;
 
 extern char *subscriber_answer_ice_ufrag;
+extern int subscriber_audio_level_extension_id;
+
+extern void lk_room_handle_join(Livekit__JoinResponse *join);
+extern void lk_room_handle_participant_update(
+    Livekit__ParticipantUpdate *update);
+extern void lk_room_handle_track_published(
+    Livekit__TrackPublishedResponse *published);
+extern void lk_room_handle_mute(Livekit__MuteTrackRequest *mute);
+extern void lk_room_handle_speakers_changed(
+    Livekit__SpeakersChanged *changed);
+extern int lk_room_take_subscription_changes(bool subscribe, char **sids);
+extern bool lk_room_take_local_mute_change(char **track_sid, bool *muted);
 
 extern PeerConnection *subscriber_peer_connection;
 extern PeerConnection *publisher_peer_connection;
 
+// Messages larger than WEBSOCKET_BUFFER_SIZE arrive as multiple
+// WEBSOCKET_EVENT_DATA chunks (and possibly continuation frames). They are
+// stitched together here. The buffer is reused, and only grows to the largest
+// message seen that didn't fit in a single chunk
+uint8_t *signal_message_buffer = NULL;
+size_t signal_message_capacity = 0;
+size_t signal_message_len = 0;
+bool signal_message_in_progress = false;
+
 static const char *request_message_to_string(
     Livekit__SignalRequest__MessageCase message_case) {
   switch (message_case) {
@@ -103,6 +126,27 @@ static const char *response_message_to_string(
   }
 }
 
+// Returns the id the offer uses for the ssrc-audio-level header extension, or
+// 0 if it doesn't offer it
+static int lk_parse_audio_level_extension_id(const char *sdp) {
+  auto extension = strstr(sdp, "urn:ietf:params:rtp-hdrext:ssrc-audio-level");
+  if (extension == NULL) {
+    return 0;
+  }
+
+  // Walk back to the start of the `a=extmap:<id> ` line
+  auto line = extension;
+  while (line > sdp && *(line - 1) != '\n') {
+    line--;
+  }
+
+  int id = 0;
+  if (sscanf(line, "a=extmap:%d", &id) != 1 || id < 1 || id > 14) {
+    return 0;
+  }
+  return id;
+}
+
 void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
   ESP_LOGI(LOG_TAG, "Recv %s",
            response_message_to_string(packet->message_case));
@@ -138,6 +182,7 @@ void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
         }
 
         xSemaphoreGive(g_mutex);
+        lk_peer_connection_wake();
       }
 
       cJSON_Delete(parsed);
@@ -153,8 +198,11 @@ void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
           subscriber_status = 1;
         }
 
+        subscriber_audio_level_extension_id =
+            lk_parse_audio_level_extension_id(packet->offer->sdp);
         subscriber_offer_buffer = strdup(packet->offer->sdp);
         xSemaphoreGive(g_mutex);
+        lk_peer_connection_wake();
       }
 
       break;
@@ -168,6 +216,7 @@ void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
       break;
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_TRACK_PUBLISHED:
       if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
+        lk_room_handle_track_published(packet->track_published);
         set_publisher_status(2);
         xSemaphoreGive(g_mutex);
       }
@@ -177,19 +226,361 @@ void lk_websocket_handle_livekit_response(Livekit__SignalResponse *packet) {
 #ifndef LINUX_BUILD
       esp_restart();
 #endif
+      break;
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_JOIN:
+      if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
+        lk_room_handle_join(packet->join);
+        xSemaphoreGive(g_mutex);
+      }
+
+      break;
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_UPDATE:
+      if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
+        lk_room_handle_participant_update(packet->update);
+        xSemaphoreGive(g_mutex);
+      }
+
       break;
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_MUTE:
+      if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
+        lk_room_handle_mute(packet->mute);
+        xSemaphoreGive(g_mutex);
+      }
+
+      break;
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_SPEAKERS_CHANGED:
+      if (xSemaphoreTake(g_mutex, portMAX_DELAY) == pdTRUE) {
+        lk_room_handle_speakers_changed(packet->speakers_changed);
+        xSemaphoreGive(g_mutex);
+      }
+
+      break;
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_ROOM_UPDATE:
     case LIVEKIT__SIGNAL_RESPONSE__MESSAGE__NOT_SET:
-    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_JOIN:
-    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_UPDATE:
       break;
     default:
       ESP_LOGI(LOG_TAG, "Unknown message type received.");
   }
 }
 
+// SignalResponse is a single oneof, so the field number of the first tag is the
+// message case. Returns -1 if the tag is malformed
+static int lk_peek_signal_response_case(const uint8_t *data, size_t len) {
+  if (len == 0) {
+    return LIVEKIT__SIGNAL_RESPONSE__MESSAGE__NOT_SET;
+  }
+
+  uint64_t tag = 0;
+  for (size_t i = 0; i < len && i < 10; i++) {
+    tag |= (uint64_t)(data[i] & 0x7F) << (7 * i);
+    if ((data[i] & 0x80) == 0) {
+      return (int)(tag >> 3);
+    }
+  }
+
+  return -1;
+}
+
+// Messages lk_websocket_handle_livekit_response doesn't act on are dropped
+// from their first chunk, before they are reassembled or unpacked. This avoids
+// allocating large ROOM_UPDATE and other unused messages in busy rooms
+static bool lk_signal_response_is_handled(int message_case) {
+  switch (message_case) {
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_TRICKLE:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_OFFER:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_ANSWER:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_TRACK_PUBLISHED:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_LEAVE:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_JOIN:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_UPDATE:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_MUTE:
+    case LIVEKIT__SIGNAL_RESPONSE__MESSAGE_SPEAKERS_CHANGED:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Fields of room messages that lk_room_* reads. Everything else in them
+// (metadata, permissions, attributes, codecs, simulcast layers...) is removed
+// before unpacking so it is never allocated. JOIN in a busy room is the
+// largest message we unpack
+static const char *const JOIN_RESPONSE_FIELDS[] = {
+    "participant", "other_participants", NULL};
+static const char *const PARTICIPANT_UPDATE_FIELDS[] = {"participants", NULL};
+static const char *const PARTICIPANT_INFO_FIELDS[] = {"sid", "identity",
+                                                      "state", "tracks", NULL};
+static const char *const TRACK_INFO_FIELDS[] = {"sid", "type", "muted", NULL};
+
+// Returns the fields to keep for a message type, or NULL to keep all of them
+static const char *const *lk_signal_kept_fields(
+    const ProtobufCMessageDescriptor *descriptor) {
+  if (descriptor == &livekit__join_response__descriptor) {
+    return JOIN_RESPONSE_FIELDS;
+  } else if (descriptor == &livekit__participant_update__descriptor) {
+    return PARTICIPANT_UPDATE_FIELDS;
+  } else if (descriptor == &livekit__participant_info__descriptor) {
+    return PARTICIPANT_INFO_FIELDS;
+  } else if (descriptor == &livekit__track_info__descriptor) {
+    return TRACK_INFO_FIELDS;
+  }
+  return NULL;
+}
+
+static bool lk_signal_field_kept(const char *const *kept, const char *name) {
+  if (kept == NULL) {
+    return true;
+  }
+  for (int i = 0; kept[i] != NULL; i++) {
+    if (strcmp(kept[i], name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool lk_read_proto_varint(const uint8_t *data, size_t len, size_t *pos,
+                                 uint64_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *pos < len; shift += 7) {
+    auto byte = data[(*pos)++];
+    *value |= (uint64_t)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t lk_write_proto_varint(uint8_t *data, uint64_t value) {
+  size_t len = 0;
+  do {
+    data[len] = value & 0x7F;
+    value >>= 7;
+    if (value != 0) {
+      data[len] |= 0x80;
+    }
+    len++;
+  } while (value != 0);
+  return len;
+}
+
+// Copies a serialized message from in to out without the fields that
+// lk_signal_kept_fields doesn't list, recursing into embedded messages. The
+// output never grows, so out needs len bytes and may be the same buffer as in.
+// Returns the new length, or -1 if the message is malformed
+static int64_t lk_prune_signal_message(
+    const uint8_t *in, size_t len, uint8_t *out,
+    const ProtobufCMessageDescriptor *descriptor) {
+  auto kept = lk_signal_kept_fields(descriptor);
+  size_t read = 0, written = 0;
+
+  while (read < len) {
+    auto field_start = read;
+    uint64_t tag, value_len = 0;
+    if (!lk_read_proto_varint(in, len, &read, &tag)) {
+      return -1;
+    }
+    auto tag_len = read - field_start;
+
+    switch (tag & 0x7) {
+      case 0:  // varint
+        if (!lk_read_proto_varint(in, len, &read, &value_len)) {
+          return -1;
+        }
+        value_len = 0;
+        break;
+      case 1:  // 64-bit
+        value_len = 8;
+        break;
+      case 2:  // length delimited
+        if (!lk_read_proto_varint(in, len, &read, &value_len)) {
+          return -1;
+        }
+        break;
+      case 5:  // 32-bit
+        value_len = 4;
+        break;
+      default:
+        return -1;
+    }
+    if (value_len > len - read) {
+      return -1;
+    }
+    auto value_start = read;
+    read += value_len;
+
+    auto field =
+        protobuf_c_message_descriptor_get_field(descriptor, tag >> 3);
+    if (field == NULL || !lk_signal_field_kept(kept, field->name)) {
+      continue;
+    }
+
+    auto nested = (const ProtobufCMessageDescriptor *)field->descriptor;
+    if ((tag & 0x7) != 2 || field->type != PROTOBUF_C_TYPE_MESSAGE ||
+        lk_signal_kept_fields(nested) == NULL) {
+      memmove(out + written, in + field_start, read - field_start);
+      written += read - field_start;
+      continue;
+    }
+
+    // Pruned to where the value would start. Its new length never needs more
+    // varint bytes than the old one, so it is then moved down behind that
+    memmove(out + written, in + field_start, tag_len);
+    written += tag_len;
+    auto nested_out = out + written + (value_start - field_start - tag_len);
+    auto nested_len = lk_prune_signal_message(in + value_start, value_len,
+                                              nested_out, nested);
+    if (nested_len < 0) {
+      return -1;
+    }
+    written += lk_write_proto_varint(out + written, nested_len);
+    memmove(out + written, nested_out, nested_len);
+    written += nested_len;
+  }
+
+  return written;
+}
+
+static bool lk_signal_message_reserve(size_t size) {
+  if (size <= signal_message_capacity) {
+    return true;
+  } else if (size > SIGNAL_MESSAGE_MAX_SIZE) {
+    return false;
+  }
+
+#ifdef LINUX_BUILD
+  auto new_buffer = (uint8_t *)realloc(signal_message_buffer, size);
+#else
+  auto new_buffer = (uint8_t *)heap_caps_realloc(signal_message_buffer, size,
+                                                 MALLOC_CAP_SPIRAM);
+#endif
+  if (new_buffer == NULL) {
+    return false;
+  }
+
+  signal_message_buffer = new_buffer;
+  signal_message_capacity = size;
+  return true;
+}
+
+// Returns false if the message couldn't be decoded
+bool lk_websocket_handle_signal_message(const uint8_t *data, size_t len) {
+  auto message_case = lk_peek_signal_response_case(data, len);
+  if (message_case != -1 && !lk_signal_response_is_handled(message_case)) {
+    ESP_LOGD(LOG_TAG, "Skip %s (%d bytes)",
+             response_message_to_string(
+                 (Livekit__SignalResponse__MessageCase)message_case),
+             (int)len);
+    return true;
+  }
+
+  if (message_case == LIVEKIT__SIGNAL_RESPONSE__MESSAGE_JOIN ||
+      message_case == LIVEKIT__SIGNAL_RESPONSE__MESSAGE_UPDATE) {
+    // Pruned into the reassembly buffer, which data already is for fragmented
+    // messages. Other buffers belong to the websocket client or the replayer
+    int64_t pruned_len = -1;
+    if (lk_signal_message_reserve(len)) {
+      pruned_len = lk_prune_signal_message(
+          data, len, signal_message_buffer,
+          &livekit__signal_response__descriptor);
+    }
+    if (pruned_len >= 0) {
+      ESP_LOGD(LOG_TAG, "Pruned %s from %d to %d bytes",
+               response_message_to_string(
+                   (Livekit__SignalResponse__MessageCase)message_case),
+               (int)len, (int)pruned_len);
+      data = signal_message_buffer;
+      len = pruned_len;
+    }
+  }
+
+  auto new_response = livekit__signal_response__unpack(NULL, len, data);
+  if (new_response == NULL) {
+    ESP_LOGE(LOG_TAG, "Failed to decode SignalResponse message.");
+#ifndef LINUX_BUILD
+    esp_restart();
+#endif
+    return false;
+  }
+
+  lk_websocket_handle_livekit_response(new_response);
+  livekit__signal_response__free_unpacked(new_response, NULL);
+  return true;
+}
+
+static void lk_websocket_handle_data(esp_websocket_event_data_t *data) {
+  // 0x0 is a continuation frame, 0x2 is a binary frame
+  if (data->op_code == 0x2 && data->payload_offset == 0) {
+    signal_message_len = 0;
+    signal_message_in_progress = true;
+
+    // Skip the whole message before anything is reserved or copied. Skipped
+    // messages aren't recorded either, replay would skip them anyway
+    auto message_case = lk_peek_signal_response_case(
+        (const uint8_t *)data->data_ptr, data->data_len);
+    if (message_case != -1 && !lk_signal_response_is_handled(message_case)) {
+      ESP_LOGD(LOG_TAG, "Skip %s (%d bytes)",
+               response_message_to_string(
+                   (Livekit__SignalResponse__MessageCase)message_case),
+               data->payload_len);
+      signal_message_in_progress = false;
+      return;
+    }
+  } else if (data->op_code != 0x0 && data->op_code != 0x2) {
+    ESP_LOGD(LOG_TAG, "Message, opcode=%d, len=%d", data->op_code,
+             data->data_len);
+    return;
+  }
+
+  if (!signal_message_in_progress) {
+    return;
+  }
+
+  auto frame_complete =
+      data->payload_offset + data->data_len >= data->payload_len;
+
+  // Whole message in a single chunk, decode it from the client's buffer
+  // without copying. Later chunks of a fragmented frame share its op_code and
+  // fin
+  if (data->op_code == 0x2 && data->payload_offset == 0 &&
+      signal_message_len == 0 && data->fin && frame_complete) {
+    signal_message_in_progress = false;
+    lk_recorder_write(LK_RECORD_SIGNAL_RESPONSE,
+                      (const uint8_t *)data->data_ptr, data->data_len);
+    lk_websocket_handle_signal_message((const uint8_t *)data->data_ptr,
+                                       data->data_len);
+    return;
+  }
+
+  // Reserve the whole frame up front so large messages only realloc once
+  if (data->payload_offset == 0 &&
+      !lk_signal_message_reserve(signal_message_len + data->payload_len)) {
+    ESP_LOGE(LOG_TAG, "Dropping SignalResponse larger than %d bytes",
+             (int)(signal_message_len + data->payload_len));
+    signal_message_in_progress = false;
+    return;
+  }
+
+  if (signal_message_len + data->data_len > signal_message_capacity) {
+    ESP_LOGE(LOG_TAG, "SignalResponse chunk overruns frame, dropping");
+    signal_message_in_progress = false;
+    return;
+  }
+
+  memcpy(signal_message_buffer + signal_message_len, data->data_ptr,
+         data->data_len);
+  signal_message_len += data->data_len;
+
+  if (data->fin && frame_complete) {
+    signal_message_in_progress = false;
+    lk_recorder_write(LK_RECORD_SIGNAL_RESPONSE, signal_message_buffer,
+                      signal_message_len);
+    lk_websocket_handle_signal_message(signal_message_buffer,
+                                       signal_message_len);
+  }
+}
+
 static void lk_websocket_event_handler(void *handler_args,
                                        esp_event_base_t base, int32_t event_id,
                                        void *event_data) {
@@ -204,29 +595,9 @@ static void lk_websocket_event_handler(void *handler_args,
       esp_restart();
 #endif
       break;
-    case WEBSOCKET_EVENT_DATA: {
-      if (data->op_code != 0x2) {
-        ESP_LOGD(LOG_TAG, "Message, opcode=%d, len=%d", data->op_code,
-                 data->data_len);
-        return;
-      }
-
-      auto new_response = livekit__signal_response__unpack(
-          NULL, data->data_len, (uint8_t *)data->data_ptr);
-
-      if (new_response == NULL) {
-        ESP_LOGE(LOG_TAG, "Failed to decode SignalResponse message.");
-#ifndef LINUX_BUILD
-        esp_restart();
-#endif
-      } else {
-        lk_websocket_handle_livekit_response(new_response);
-      }
-
-      livekit__signal_response__free_unpacked(new_response, NULL);
-
+    case WEBSOCKET_EVENT_DATA:
+      lk_websocket_handle_data(data);
       break;
-    }
     case WEBSOCKET_EVENT_ERROR:
       ESP_LOGI(LOG_TAG, "WEBSOCKET_EVENT_ERROR");
 #ifndef LINUX_BUILD
@@ -242,6 +613,7 @@ void lk_pack_and_send_signal_request(const Livekit__SignalRequest *r,
   auto size = livekit__signal_request__get_packed_size(r);
   auto *buffer = (uint8_t *)malloc(size);
   livekit__signal_request__pack(r, buffer);
+  lk_recorder_write(LK_RECORD_SIGNAL_REQUEST, buffer, size);
   auto len = esp_websocket_client_send_bin(client, (char *)buffer, size,
                                            portMAX_DELAY);
   free(buffer);
@@ -250,6 +622,56 @@ void lk_pack_and_send_signal_request(const Livekit__SignalRequest *r,
   }
 }
 
+// Tell the server about tracks whose subscription changed since last time.
+// Must be called with g_mutex held
+static void lk_send_subscription_updates(esp_websocket_client *client) {
+  char *track_sids[ROOM_MAX_TRACKS];
+
+  for (int subscribe = 0; subscribe <= 1; subscribe++) {
+    auto count = lk_room_take_subscription_changes(subscribe, track_sids);
+    if (count == 0) {
+      continue;
+    }
+
+    Livekit__SignalRequest r = LIVEKIT__SIGNAL_REQUEST__INIT;
+#if LK_AUTO_SUBSCRIBE
+    Livekit__UpdateTrackSettings t = LIVEKIT__UPDATE_TRACK_SETTINGS__INIT;
+    t.n_track_sids = count;
+    t.track_sids = track_sids;
+    t.disabled = !subscribe;
+    r.track_setting = &t;
+    r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_TRACK_SETTING;
+#else
+    Livekit__UpdateSubscription u = LIVEKIT__UPDATE_SUBSCRIPTION__INIT;
+    u.n_track_sids = count;
+    u.track_sids = track_sids;
+    u.subscribe = subscribe;
+    r.subscription = &u;
+    r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_SUBSCRIPTION;
+#endif
+
+    lk_pack_and_send_signal_request(&r, client);
+  }
+}
+
+// Confirm a server mute of our track, like other clients do once they have
+// applied it. Must be called with g_mutex held
+static void lk_send_local_mute(esp_websocket_client *client) {
+  char *track_sid;
+  bool muted;
+  if (!lk_room_take_local_mute_change(&track_sid, &muted)) {
+    return;
+  }
+
+  Livekit__SignalRequest r = LIVEKIT__SIGNAL_REQUEST__INIT;
+  Livekit__MuteTrackRequest m = LIVEKIT__MUTE_TRACK_REQUEST__INIT;
+  m.sid = track_sid;
+  m.muted = muted;
+  r.mute = &m;
+  r.message_case = LIVEKIT__SIGNAL_REQUEST__MESSAGE_MUTE;
+  lk_pack_and_send_signal_request(&r, client);
+}
+
 void lk_websocket(const char *room_url, const char *token) {
   g_mutex = xSemaphoreCreateMutex();
   if (g_mutex == NULL) {
@@ -263,8 +685,9 @@ void lk_websocket(const char *room_url, const char *token) {
 
   char *ws_uri = (char *)malloc(WEBSOCKET_URI_SIZE);
   snprintf(ws_uri, WEBSOCKET_URI_SIZE,
-           "%s/rtc?protocol=%d&access_token=%s&auto_subscribe=true", room_url,
-           LIVEKIT_PROTOCOL_VERSION, token);
+           "%s/rtc?protocol=%d&access_token=%s&auto_subscribe=%s", room_url,
+           LIVEKIT_PROTOCOL_VERSION, token,
+           LK_AUTO_SUBSCRIBE ? "true" : "false");
   ESP_LOGI(LOG_TAG, "WebSocket URI: %s", ws_uri);
 
   esp_websocket_client_config_t ws_cfg;
@@ -366,6 +789,9 @@ void lk_websocket(const char *room_url, const char *token) {
         subscriber_status = 0;
       }
 
+      lk_send_subscription_updates(client);
+      lk_send_local_mute(client);
+
       xSemaphoreGive(g_mutex);
     }
     vTaskDelay(pdMS_TO_TICKS(200));
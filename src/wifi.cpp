@@ -1,38 +1,99 @@
 #include <assert.h>
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include "main.h"
 
+// Reconnects back off exponentially up to WIFI_RECONNECT_MAX_DELAY_MS and
+// never give up
+#define WIFI_RECONNECT_BASE_DELAY_MS 250
+#define WIFI_RECONNECT_MAX_DELAY_MS 30000
+
+// Most APs beacon every 100 TU (102.4ms)
+#define WIFI_BEACON_INTERVAL_MS 102
+
+// Set WIFI_LOW_LATENCY_TX_RATE (e.g. WIFI_PHY_RATE_MCS4_SGI) to pin the TX
+// rate in the low latency profile. No airtime is lost probing other rates,
+// but there is no fallback either, so loss rises quickly at weak RSSI
+
 static bool g_wifi_connected = false;
+static esp_timer_handle_t g_wifi_reconnect_timer = NULL;
+
+static void lk_wifi_reconnect(void *arg) {
+  ESP_LOGI(LOG_TAG, "retry to connect to the AP");
+  esp_wifi_connect();
+}
 
 static void lk_event_handler(void *arg, esp_event_base_t event_base,
                              int32_t event_id, void *event_data) {
   static int s_retry_num = 0;
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    if (s_retry_num < 5) {
-      esp_wifi_connect();
-      s_retry_num++;
-      ESP_LOGI(LOG_TAG, "retry to connect to the AP");
+    g_wifi_connected = false;
+
+    uint32_t delay_ms = WIFI_RECONNECT_MAX_DELAY_MS;
+    if (s_retry_num < 16) {
+      delay_ms = MIN(WIFI_RECONNECT_BASE_DELAY_MS << s_retry_num,
+                     WIFI_RECONNECT_MAX_DELAY_MS);
     }
-    ESP_LOGI(LOG_TAG, "connect to the AP fail");
+    s_retry_num++;
+
+    ESP_LOGI(LOG_TAG, "connect to the AP fail, retry %d in %lums", s_retry_num,
+             (unsigned long)delay_ms);
+    esp_timer_stop(g_wifi_reconnect_timer);
+    esp_timer_start_once(g_wifi_reconnect_timer, delay_ms * 1000);
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
     ESP_LOGI(LOG_TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+    s_retry_num = 0;
     g_wifi_connected = true;
   }
 }
 
+// Apply settings for WIFI_PROFILE that must be set before connecting
+static void lk_wifi_apply_profile(wifi_config_t *wifi_config) {
+#if WIFI_PROFILE == WIFI_PROFILE_BATTERY
+  // Wake for every Nth beacon. A packet the AP holds for N beacons must still
+  // arrive before playout runs dry, so N beacons and one received packet have
+  // to fit in the jitter buffer. With the default 200ms buffer N is 1, so the
+  // radio sleeps between beacons but never skips one
+  wifi_config->sta.listen_interval =
+      MAX(1, (JITTER_BUFFER_MS - OPUS_RECEIVE_PTIME_MS) /
+                 WIFI_BEACON_INTERVAL_MS);
+  ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
+  ESP_LOGI(LOG_TAG, "Wi-Fi profile: battery (listen interval %d)",
+           wifi_config->sta.listen_interval);
+#else
+  // Modem sleep holds received packets at the AP until the next beacon, which
+  // adds tens of ms of jitter to every RTP packet
+  ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
+
+  // Don't let 802.11k/v trigger background scans while in a call
+  wifi_config->sta.rm_enabled = 0;
+  wifi_config->sta.btm_enabled = 0;
+  wifi_config->sta.mbo_enabled = 0;
+  ESP_LOGI(LOG_TAG, "Wi-Fi profile: low latency");
+#endif
+}
+
 void lk_wifi(void) {
   ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
                                              &lk_event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
                                              &lk_event_handler, NULL));
 
+  esp_timer_create_args_t reconnect_timer_args;
+  memset(&reconnect_timer_args, 0, sizeof(reconnect_timer_args));
+  reconnect_timer_args.callback = lk_wifi_reconnect;
+  reconnect_timer_args.name = "lk_wifi_reconnect";
+  ESP_ERROR_CHECK(
+      esp_timer_create(&reconnect_timer_args, &g_wifi_reconnect_timer));
+
   ESP_ERROR_CHECK(esp_netif_init());
   esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
   assert(sta_netif);
@@ -40,6 +101,17 @@ void lk_wifi(void) {
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+
+#if WIFI_PROFILE == WIFI_PROFILE_LOW_LATENCY && defined(WIFI_LOW_LATENCY_TX_RATE)
+  // Must be set between esp_wifi_init and esp_wifi_start
+  auto tx_rate_err =
+      esp_wifi_config_80211_tx_rate(WIFI_IF_STA, WIFI_LOW_LATENCY_TX_RATE);
+  if (tx_rate_err != ESP_OK) {
+    ESP_LOGI(LOG_TAG, "Failed to pin Wi-Fi TX rate: %s",
+             esp_err_to_name(tx_rate_err));
+  }
+#endif
+
   ESP_ERROR_CHECK(esp_wifi_start());
 
   ESP_LOGI(LOG_TAG, "Connecting to WiFi SSID: %s", WIFI_SSID);
@@ -49,9 +121,11 @@ void lk_wifi(void) {
           sizeof(wifi_config.sta.ssid));
   strncpy((char *)wifi_config.sta.password, (char *)WIFI_PASSWORD,
           sizeof(wifi_config.sta.password));
+  lk_wifi_apply_profile(&wifi_config);
 
   ESP_ERROR_CHECK(esp_wifi_set_config(
       static_cast<wifi_interface_t>(ESP_IF_WIFI_STA), &wifi_config));
+
   ESP_ERROR_CHECK(esp_wifi_connect());
 
   // block until we get an IP address